@@ -13,19 +13,84 @@
 #include <sys/wait.h>
 #include <limits.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/timerfd.h>
 
 
 /* [> Defines <] */
 #define PARAMS_BUFSIZE 	21
 #define INPUT_BUFSIZE 	120
 #define PATH_BUFSIZE 	1024
-#define NO_BUILTINS 	5
+#define NO_BUILTINS 	12
 #define MAX_BLOCKS 		64
 #define BLOCK_SIZE 		8
+#define MAX_HISTORY 	(MAX_BLOCKS*10)
+#define HIST_MAX_DEPTH 	8
+#define HIST_IGNOREDUPS 1
+#define HIST_ERASEDUPS 	2
+#define MAX_JOBS 		1024
+#define MAX_QUEUED 		4096
+#define ARENA_CHUNK 	16384
+#define POOL_SLAB 		32
+#define STATS_MAX 		128
+#define STATS_NAME 		32
+#define STATS_SUB_BITS 	3
+#define STATS_SUB 		(1 << STATS_SUB_BITS)
+#define STATS_BUCKETS 	((64 - STATS_SUB_BITS + 1) * STATS_SUB)
+#define STATS_FLUSH_SEC 60
+#define STAT_PARSE 		0
+#define STAT_LAUNCH 	1
+#define STAT_RUN 		2
+#define STAT_WAIT 		3
+#define STAT_PHASES 	4
+#define GLOB_CACHE 		8
+#define GLOB_DENTS_BUF 	(256*1024)
+#define GLOB_CHAR 		0
+#define GLOB_ANY 		1
+#define GLOB_STAR 		2
+#define GLOB_SET 		3
+#define COMP_PATH_DIRS 	64
+#define COMP_SHOW 		100
+#define BATCH_MAX_JOBS 	64
+#define BATCH_HEADROOM 	2048
+#define MUX_OFF 		0
+#define MUX_TAG 		1
+#define MUX_GROUP 		2
+#define MUX_READ 		(64*1024)
+#define MUX_IOV 		64
+#define SCRIPT_MAGIC 	0x6373796d
+#define SCRIPT_VERSION 	3
+#define SCRIPT_GLOB 	1
+#define SCRIPT_SUBST 	2
+#define FANOUT_MAX 		16
+#define FANOUT_PIPE_SZ 	(1024*1024)
+#define SUBST_READ 		(64*1024)
+#define VAR_SLOTS 		64
+#define VAR_NAME 		256
+#define VAR_VALUE 		32
+#define SHIST_SLOTS 	1024
+#define SHIST_MAGIC 	0x6d797368
 #define ARGS_DELIM 		" \t\r\n\a\f\v\b\0"
 #define TRUE 			1
 #define FALSE 			0
 #define BG_SIGN 		"&"
+#define FANOUT_SIGN 	"|>"
+#define PLACE_CPU_NONE 	0
+#define PLACE_CPU_SET 	1
+#define PLACE_CPU_RR 	2
+#define PLACE_NICE_NONE INT_MIN
+#define PSI_RECHECK_MS 	2000
 
 
 /* [> Structs <] */
@@ -33,17 +98,25 @@
 /*
  * Struct:  md
  * --------------------
- * 	Metadata struct for storing commands in history. Used as a node/element i a linked list.
+ * 	Metadata struct for storing commands in history. Used as an element in a ring buffer deque.
+ * 	Commands are front coded: the first 'shared' bytes are the same as in the next (older)
+ * 	command, only the rest is stored, in a run of consecutive datablocks.
  *
- * 	*next: Pointer to next md in list 
+ * 	hash: Hash of the full command, for finding duplicates
  * 	len: Length of command 
- * 	d_index: Array for storing index pointers to datablocks in history memory datastructure.
+ * 	shared: Length of the prefix shared with the next command
+ * 	depth: Number of commands to follow to decode the shared prefix
+ * 	block: Index of the first datablock in history memory datastructure.
+ * 	no_blocks: Number of datablocks, 0 if the whole command is shared.
  *
  */
 typedef struct md{
-    struct md *next;
-	int len;
-	int d_index[15];
+	uint32_t hash;
+	unsigned char len;
+	unsigned char shared;
+	unsigned char depth;
+	unsigned char block;
+	unsigned char no_blocks;
 }md;
 
 /*
@@ -53,13 +126,378 @@ typedef struct md{
  *
  * 	bm: Bitmap location
  * 	hist: Data blocks location
+ * 	md: Metadata ring buffer, indexed by history number
+ * 	first: Ring position of the oldest metadata
+ * 	no_md: Number of commands in history
  *
  */
 typedef struct h_mem{
 	unsigned char bm[BLOCK_SIZE];
 	char hist[MAX_BLOCKS*BLOCK_SIZE];
+	struct md md[MAX_HISTORY];
+	int first;
+	int no_md;
 } h_mem;
 
+/*
+ * Struct:  arena_chunk
+ * --------------------
+ * 	Chunk of memory in an arena.
+ *
+ * 	next: Next chunk
+ * 	size: Size of data
+ * 	used: Bytes of data handed out
+ * 	data: Memory
+ *
+ */
+typedef struct arena_chunk{
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+} arena_chunk;
+
+/*
+ * Struct:  arena_mapping
+ * --------------------
+ * 	File mapped for the rest of a command line (using arena_map).
+ *
+ * 	next: Next mapping
+ * 	addr: Start of the mapping
+ * 	size: Size of the mapping
+ *
+ */
+typedef struct arena_mapping{
+	struct arena_mapping *next;
+	void *addr;
+	size_t size;
+} arena_mapping;
+
+/*
+ * Struct:  arena
+ * --------------------
+ * 	Bump pointer allocator for memory that lives for one command line: tokens, argv and
+ * 	expansions. Reset before each command, chunks are kept for the next.
+ *
+ * 	head: First chunk
+ * 	cur: Chunk allocations are made from
+ * 	maps: Mappings removed at reset, too large to keep in chunks
+ *
+ */
+typedef struct arena{
+	struct arena_chunk *head;
+	struct arena_chunk *cur;
+	struct arena_mapping *maps;
+} arena;
+
+/*
+ * Struct:  pool
+ * --------------------
+ * 	Allocator for fixed size, long lived objects such as jobs. Objects are allocated in
+ * 	slabs of POOL_SLAB and reused through a free list.
+ *
+ * 	size: Object size
+ * 	free: Free list, linked through the first bytes of each free object
+ * 	no_used: Number of objects in use
+ * 	no_slabs: Number of slabs allocated
+ *
+ */
+typedef struct pool{
+	size_t size;
+	void *free;
+	size_t no_used;
+	size_t no_slabs;
+} pool;
+
+/*
+ * Struct:  alloc_stats
+ * --------------------
+ * 	Allocation counters.
+ *
+ * 	mallocs: Heap allocations made by the shell (using mysh_malloc)
+ * 	arena_allocs: Allocations from the command arena
+ * 	arena_resets: Number of arena resets, one per command line
+ * 	arena_used: Bytes used in the arena by the current command
+ * 	arena_high: Most bytes used by one command
+ * 	arena_size: Bytes in arena chunks
+ * 	pool_allocs: Allocations from pools
+ * 	pool_frees: Objects returned to pools
+ *
+ */
+typedef struct alloc_stats{
+	unsigned long mallocs;
+	unsigned long arena_allocs;
+	unsigned long arena_resets;
+	size_t arena_used;
+	size_t arena_high;
+	size_t arena_size;
+	unsigned long pool_allocs;
+	unsigned long pool_frees;
+} alloc_stats;
+
+/*
+ * Struct:  var
+ * --------------------
+ * 	Shell variable, a slot in the open addressing variable table.
+ *
+ * 	hash: Hash of the name
+ * 	name: Interned name, NULL for an empty slot
+ * 	value: Value, in a buffer reused when the variable is set again
+ * 	size: Size of the value buffer
+ *
+ */
+typedef struct var{
+	uint32_t hash;
+	char *name;
+	char *value;
+	size_t size;
+} var;
+
+/*
+ * Struct:  meminfo
+ * --------------------
+ * 	Memory use of the shell's data structures, as reported by meminfo.
+ *
+ * 	hist_cmds: Commands in history
+ * 	hist_bytes: Length of the commands in history, before front coding
+ * 	hist_blocks_used: History datablocks in use
+ * 	hist_free_runs: Runs of consecutive free datablocks
+ * 	hist_largest_run: Datablocks in the largest free run
+ * 	jobs, queued: Running background jobs and queued jobs
+ * 	job_slabs, qjob_slabs: Slabs in the job and queued job pools
+ * 	job_output: Bytes of job output buffers
+ * 	dcache_dirs, dcache_names, dcache_bytes: Listings, names and bytes in the glob cache
+ * 	pindex_dirs, pindex_names, pindex_bytes: The same for the PATH index
+ * 	no_stats, stats_bytes: Commands with stats and bytes of the stats pool
+ * 	no_vars, vars_cap, vars_bytes: Variables, slots and bytes of the variable table
+ * 	rss, rss_peak: Resident set size and its peak, in bytes
+ *
+ */
+typedef struct meminfo{
+	int hist_cmds;
+	size_t hist_bytes;
+	int hist_blocks_used;
+	int hist_free_runs;
+	int hist_largest_run;
+	size_t jobs;
+	size_t queued;
+	size_t job_slabs;
+	size_t qjob_slabs;
+	size_t job_output;
+	int dcache_dirs;
+	size_t dcache_names;
+	size_t dcache_bytes;
+	int pindex_dirs;
+	size_t pindex_names;
+	size_t pindex_bytes;
+	int no_stats;
+	size_t stats_bytes;
+	size_t no_vars;
+	size_t vars_cap;
+	size_t vars_bytes;
+	size_t rss;
+	size_t rss_peak;
+} meminfo;
+
+/*
+ * Struct:  cmd_stats
+ * --------------------
+ * 	Latency histograms of one command, per phase (STAT_*). Histograms are log-linear:
+ * 	STATS_SUB buckets per power of two nanoseconds.
+ *
+ * 	name: Command name
+ * 	count: Number of samples
+ * 	sum: Sum of samples in ns
+ * 	max: Largest sample in ns
+ * 	hist: Sample counts per bucket
+ *
+ */
+typedef struct cmd_stats{
+	char name[STATS_NAME];
+	uint64_t count[STAT_PHASES];
+	uint64_t sum[STAT_PHASES];
+	uint64_t max[STAT_PHASES];
+	uint32_t hist[STAT_PHASES][STATS_BUCKETS];
+} cmd_stats;
+
+/*
+ * Struct:  glob_op
+ * --------------------
+ * 	One step of a compiled glob pattern.
+ *
+ * 	type: GLOB_CHAR (c), GLOB_ANY (?), GLOB_STAR (*) or GLOB_SET ([...])
+ * 	c: Character to match for GLOB_CHAR
+ * 	set: Bitmap of the characters matched by GLOB_SET, negation already applied
+ *
+ */
+typedef struct glob_op{
+	unsigned char type;
+	unsigned char c;
+	uint32_t set[8];
+} glob_op;
+
+/*
+ * Struct:  dir_list
+ * --------------------
+ * 	Cached listing of a directory, sorted by name. Valid while the directory has the same
+ * 	device, inode and mtime.
+ *
+ * 	path: Directory as written in the pattern, "" for the current directory
+ * 	dev, ino, mtime: Identity and mtime of the directory when it was read
+ * 	valid: The listing can be reused, i.e the mtime was not too recent to trust
+ * 	tick: Last use, for LRU replacement
+ * 	buf: Entries as a type byte (d_type) followed by the NUL terminated name
+ * 	buf_size, buf_used: Size and used bytes of buf
+ * 	names: Sorted names, pointing into buf. The type is at names[i][-1].
+ * 	no_names, names_cap: Number of names and size of names
+ *
+ */
+typedef struct dir_list{
+	char path[PATH_BUFSIZE];
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int valid;
+	unsigned long tick;
+	char *buf;
+	size_t buf_size;
+	size_t buf_used;
+	char **names;
+	int no_names;
+	int names_cap;
+} dir_list;
+
+/*
+ * Struct:  script_hdr
+ * --------------------
+ * 	Header of a compiled script, followed by no_cmds script_cmd, no_args string offsets
+ * 	of the arguments and str_size bytes of NUL terminated strings. Offsets instead of
+ * 	pointers, so the file can be mapped and run as is.
+ *
+ * 	magic, version: SCRIPT_MAGIC and SCRIPT_VERSION
+ * 	dev, ino, size, mtime_sec, mtime_nsec: Identity of the script it was compiled from
+ * 	hash: Hash of the script contents
+ * 	path_hash: Hash of PATH, executables were resolved with it
+ * 	no_cmds: Number of commands
+ * 	no_args: Number of arguments of all commands
+ * 	str_size: Size of the strings
+ *
+ */
+typedef struct script_hdr{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	uint64_t path_hash;
+	uint32_t no_cmds;
+	uint32_t no_args;
+	uint32_t str_size;
+	uint32_t pad;
+} script_hdr;
+
+/*
+ * Struct:  script_cmd
+ * --------------------
+ * 	Command of a compiled script.
+ *
+ * 	builtin: Index of the builtin, -1 if not a builtin
+ * 	flags: SCRIPT_GLOB if an argument may need glob expansion, SCRIPT_SUBST if the
+ * 	       command is kept as one line to split when run (expansions)
+ * 	argc: Number of arguments, including the command
+ * 	arg: Index of the first argument's offset
+ * 	path: Offset of the resolved executable, 0 if not resolved
+ *
+ */
+typedef struct script_cmd{
+	int32_t builtin;
+	uint32_t flags;
+	uint32_t argc;
+	uint32_t arg;
+	uint32_t path;
+} script_cmd;
+
+/*
+ * Struct:  shist_entry
+ * --------------------
+ * 	Command in the shared history segment.
+ *
+ * 	seq: Sequence number + 1 when the entry is complete, 0 while it is written
+ * 	session: Pid of the session that ran the command
+ * 	len: Length of the command
+ * 	time: Time the command was run
+ * 	cmd: Command
+ *
+ */
+typedef struct shist_entry{
+	uint64_t seq;
+	pid_t session;
+	uint32_t len;
+	int64_t time;
+	char cmd[INPUT_BUFSIZE];
+} shist_entry;
+
+/*
+ * Struct:  shist
+ * --------------------
+ * 	Shared memory segment with the history of all sessions, a ring of SHIST_SLOTS entries.
+ *
+ * 	magic: SHIST_MAGIC once the segment is in use
+ * 	next: Sequence number of the next entry, reserved with an atomic add
+ * 	entries: Ring of entries, entry 'seq' is in slot seq % SHIST_SLOTS
+ *
+ */
+typedef struct shist{
+	uint32_t magic;
+	uint64_t next;
+	struct shist_entry entries[SHIST_SLOTS];
+} shist;
+
+/*
+ * Struct:  placement
+ * --------------------
+ * 	Placement policy for background jobs: where they may run and at what priority.
+ *
+ * 	cpu_mode: PLACE_CPU_NONE (inherit), PLACE_CPU_SET (fixed set) or PLACE_CPU_RR (one cpu per job, round-robin)
+ * 	cpus: Cpu set, or the pool to pick from when round-robin. Empty pool means all cpus of the shell.
+ * 	node: NUMA node to bind cpus and preferred memory to, -1 if none
+ * 	nice: Nice value, PLACE_NICE_NONE if inherited
+ * 	io_class: IO priority class (1: rt, 2: be, 3: idle), 0 if inherited
+ * 	io_level: IO priority level within the class (0-7)
+ * 	cgroup: cgroup-v2 directory to create a leaf 'job-<pid>' in, empty if none
+ *
+ */
+typedef struct placement{
+	int cpu_mode;
+	cpu_set_t cpus;
+	int node;
+	int nice;
+	int io_class;
+	int io_level;
+	char cgroup[PATH_BUFSIZE];
+} placement;
+
+/*
+ * Struct:  deadline
+ * --------------------
+ * 	Time limit of a command, a timerfd handled by the event loop.
+ *
+ * 	fd: Armed timerfd, -1 if none
+ * 	sig: Signal sent to the process group first
+ * 	grace: Nanoseconds from sig until SIGKILL, 0 for no SIGKILL
+ * 	stage: 0 before the deadline, 1 after sig was sent, 2 after SIGKILL
+ *
+ */
+typedef struct deadline{
+	int fd;
+	int sig;
+	uint64_t grace;
+	int stage;
+} deadline;
+
 /*
  * Struct:  job
  * --------------------
@@ -67,13 +505,50 @@ typedef struct h_mem{
  *
  * 	pid: Process pid of the job
  * 	cmd: Command run to start the job
+ * 	place: Resolved placement the job was started with
+ * 	start: Time the job was started (stats_now), 0 if stats were off
+ * 	out_fd: Read end of the pipe with the job's output, -1 if it writes to the terminal
+ * 	out_mode: MUX_TAG (tagged lines) or MUX_GROUP (all output when the job ends)
+ * 	tag: Prefix of the job's output lines, "[%n pid] "
+ * 	out: Output not written yet: the unfinished line, or all output when grouped
+ * 	out_len, out_size: Length and size of out
+ * 	timer: Deadline set with timeout
  *
  */
 typedef struct job{
 	pid_t pid;
+	uint64_t start;
 	char cmd[INPUT_BUFSIZE];
+	struct placement place;
+	int out_fd;
+	int out_mode;
+	char tag[32];
+	char *out;
+	size_t out_len;
+	size_t out_size;
+	struct deadline timer;
 } job;
 
+/*
+ * Struct:  qjob
+ * --------------------
+ * 	Background job waiting for admission in the job queue.
+ *
+ * 	seq: Queue order, breaks ties between equal priorities
+ * 	prio: Priority, lower is admitted first. Nice value of the placement policy.
+ * 	argv: Command and arguments without '&', one allocation
+ * 	cmd: Command line without '&', for display
+ * 	place: Placement policy the job was queued with
+ *
+ */
+typedef struct qjob{
+	unsigned long seq;
+	int prio;
+	char **argv;
+	char cmd[INPUT_BUFSIZE];
+	struct placement place;
+} qjob;
+
 /*
  * Struct:  mysh
  * --------------------
@@ -81,17 +556,109 @@ typedef struct job{
  *
  * 	signal_flag: Signal flag for the signal handler.
  * 	cur_user: Current username.
- * 	head: Pointer to the head of the md linked list.
- * 	jobs: Pointer to the dynamically struct array for storing jobs.
+ * 	hist_control: Duplicate handling, HIST_IGNOREDUPS and/or HIST_ERASEDUPS (from $HISTCONTROL)
+ * 	hist_saved: The command being run was saved to history.
+ * 	shist: Shared history segment, NULL unless $MYSH_SHARED_HISTORY is set.
+ * 	jobs: Array of running jobs, allocated from job_pool.
  * 	no_jobs: Number of jobs running.
+ * 	place: Default placement policy for new background jobs.
+ * 	rr_next: Last cpu handed out by round-robin placement.
+ * 	queue: Binary heap of background jobs waiting for admission, allocated from qjob_pool.
+ * 	no_queued: Number of jobs in queue.
+ * 	queue_seq: Sequence number of the next queued job.
+ * 	queue_on: Send background jobs through the admission queue.
+ * 	queue_stalled: Queue is held back by pressure, not job count.
+ * 	max_running: Admit while fewer background jobs run, 0 for no limit.
+ * 	max_cpu_psi: Admit while cpu pressure (some avg10) is at most this, negative for no limit.
+ * 	max_mem_psi: Admit while memory pressure (some avg10) is at most this, negative for no limit.
+ * 	ev_fd: Self-pipe turning SIGCHLD into an event.
+ * 	fg_pid: Pid of the foreground child, 0 if none.
+ * 	fg_status: Wait status of the last foreground child.
+ * 	arena: Arena for the current command line.
+ * 	job_pool: Pool for jobs.
+ * 	qjob_pool: Pool for queued jobs.
+ * 	stats_on: Record command latencies.
+ * 	stats: Hash table of command latency stats, allocated from stats_pool.
+ * 	no_stats: Number of commands in stats.
+ * 	stats_pool: Pool for command stats.
+ * 	stats_file: File to write stats to periodically and at exit ($MYSH_STATS_FILE), NULL if none.
+ * 	stats_written: Time stats were last written.
+ * 	fg_end: Time the foreground child was reaped (stats_now).
+ * 	dcache: Directory listings cached for glob expansion.
+ * 	dcache_tick: Counter for LRU replacement in dcache.
+ * 	dcache_hits, dcache_misses: Listings reused and read.
+ * 	tty: Stdin is a terminal, lines are edited by mysh.
+ * 	tty_saved: Terminal mode to run commands in.
+ * 	prompt: Current prompt, for redrawing the line.
+ * 	pindex: Sorted executables of each PATH directory, for completion.
+ * 	no_pindex: Number of PATH directories in pindex.
+ * 	glob_first, glob_last: First and last argument of the command expanded from a glob, -1 if none.
+ * 	batch_on: Split commands whose arguments do not fit in one execve.
+ * 	batch_jobs: Max invocations of a split command running at once.
+ * 	batch_pids: Running invocations of the split command, or stages of a fan-out.
+ * 	no_batch_running: Number of running invocations.
+ * 	batch_code: Combined exit status of the invocations, as in xargs.
+ * 	batch_failed: Number of invocations that failed.
+ * 	mux_mode: Output of new background jobs: MUX_OFF (terminal), MUX_TAG or MUX_GROUP.
+ * 	fg_deadline: Deadline of the foreground command, set with timeout.
+ * 	vars: Variable table, vars_cap slots (a power of two), no_vars used.
+ * 	term_fd: The shell's stdout while a builtin's output is captured, -1 when not.
  *
  */
 typedef struct mysh{
 	volatile sig_atomic_t signal_flag;
     char cur_user[INPUT_BUFSIZE];
-	struct md *head;
-	struct job *jobs;
+	int hist_control;
+	int hist_saved;
+	struct shist *shist;
+	struct job *jobs[MAX_JOBS];
 	size_t no_jobs;
+	struct placement place;
+	int rr_next;
+	struct qjob *queue[MAX_QUEUED];
+	size_t no_queued;
+	unsigned long queue_seq;
+	int queue_on;
+	int queue_stalled;
+	size_t max_running;
+	double max_cpu_psi;
+	double max_mem_psi;
+	int ev_fd[2];
+	volatile pid_t fg_pid;
+	int fg_status;
+	struct arena arena;
+	struct pool job_pool;
+	struct pool qjob_pool;
+	int stats_on;
+	struct cmd_stats *stats[STATS_MAX];
+	int no_stats;
+	struct pool stats_pool;
+	char *stats_file;
+	time_t stats_written;
+	uint64_t fg_end;
+	struct dir_list dcache[GLOB_CACHE];
+	unsigned long dcache_tick;
+	unsigned long dcache_hits;
+	unsigned long dcache_misses;
+	int tty;
+	struct termios tty_saved;
+	char prompt[INPUT_BUFSIZE + 32];
+	struct dir_list pindex[COMP_PATH_DIRS];
+	int no_pindex;
+	int glob_first;
+	int glob_last;
+	int batch_on;
+	int batch_jobs;
+	pid_t batch_pids[BATCH_MAX_JOBS];
+	int no_batch_running;
+	int batch_code;
+	int batch_failed;
+	int mux_mode;
+	struct deadline fg_deadline;
+	struct var *vars;
+	size_t vars_cap;
+	size_t no_vars;
+	int term_fd;
 } mysh;
 
 
@@ -104,23 +671,31 @@ void init();
 
 int read_stdin(char *str);
 
-int strtok_param(char *str, char **saveptr);
+int strtok_param(char *str, char ***saveptr);
+
+int split_line(char *line, char ***param);
+
+int builtin_index(const char *cmd);
 
 int param_parser(char **param, int no_params);
 
+int run_command(char **param, int no_params, int builtin, const char *path);
+
 int exec_process(char **args);
 
 int cmds_len();
 
 int exec_command(char *cmd, char *argv[]);
 
+int launch_job(char **param, placement *policy);
+
 void debug_bitmap(unsigned char *a);
 
 void debug_datablocks(char *a);
 
 int save_command(char *line);
 
-int save_job(pid_t pid, char **cmd);
+int save_job(pid_t pid, char **cmd, placement *pl);
 
 int remove_job(pid_t pid);
 
@@ -136,15 +711,251 @@ int mysh_jobs(char **args);
 
 int mysh_kill(char **args);
 
+int mysh_place(char **args);
+
+int mysh_queue(char **args);
+
+int mysh_stats(char **args);
+
+int mysh_batch(char **args);
+
+int mysh_output(char **args);
+
+int mysh_meminfo(char **args);
+
+int mysh_timeout(char **args);
 
-/* [> Functions for history metadata structure (../src/mdll.c)<] */
-void push(md **head, int len, int *d_i);
 
-md *pop(md *head);
+/* [> Functions for history metadata structure (../src/mdq.c)<] */
+md *md_get(int n);
 
-void remove_all(md *head);
+md *md_push();
 
-md *remove_n(md *head, int n);
+void md_remove(int n);
+
+
+/* [> Functions for history storage (../src/hist.c)<] */
+uint32_t hist_hash(const char *line, size_t len);
+
+int hist_view(int n, struct iovec *iov);
+
+int hist_decode(int n, char *buf);
+
+int hist_equal(int n, const char *line, size_t len, uint32_t hash);
+
+void hist_compact();
+
+int hist_store(md *e, const char *line);
+
+void hist_release(md *e);
+
+void hist_remove(int n);
+
+int hist_evict();
+
+
+/* [> Memory allocators (../src/arena.c)<] */
+void *mysh_malloc(size_t size);
+
+void *mysh_realloc(void *ptr, size_t size);
+
+void *arena_alloc(arena *a, size_t size);
+
+char *arena_strndup(arena *a, const char *str, size_t len);
+
+void *arena_map(arena *a, int fd, size_t size);
+
+void arena_reset(arena *a);
+
+void pool_init(pool *p, size_t size);
+
+void *pool_alloc(pool *p);
+
+void pool_free(pool *p, void *obj);
+
+
+/* [> Command latency stats (../src/stats.c)<] */
+uint64_t stats_now();
+
+cmd_stats *stats_find(const char *cmd);
+
+void stats_record(const char *cmd, int phase, uint64_t ns);
+
+uint64_t stats_percentile(cmd_stats *s, int phase, double q);
+
+void stats_print();
+
+int stats_write(const char *path);
+
+void stats_flush(int force);
+
+void stats_reset();
+
+
+/* [> Glob expansion (../src/glob.c)<] */
+int glob_compile(const char *pat, glob_op **ops, char **prefix);
+
+int glob_match(const glob_op *ops, int no_ops, const char *str);
+
+int dir_load(dir_list *d, const char *path);
+
+dir_list *dir_get(const char *path);
+
+int dir_find(dir_list *d, const char *prefix, size_t len);
+
+int glob_expand(char ***param, int no_params);
+
+
+/* [> Line editing and completion (../src/comp.c)<] */
+void tty_mode(int raw);
+
+int edit_char(char *line, size_t *pos, size_t len, char c);
+
+void comp_index();
+
+void comp_complete(char *line, size_t *pos, size_t len);
+
+
+/* [> Argument batching (../src/batch.c)<] */
+size_t arg_limit();
+
+int batch_needed(char **param, int no_params);
+
+int batch_run(char **param, int no_params);
+
+int batch_reap(pid_t pid, int status);
+
+
+/* [> Output multiplexing of background jobs (../src/mux.c)<] */
+int mux_pipe(int fds[2]);
+
+void mux_attach(job *j, int fd, int num);
+
+void mux_read(job *j);
+
+void mux_flush(job *j);
+
+int mux_pollfds(struct pollfd *fds);
+
+void mux_events(struct pollfd *fds, int n);
+
+
+/* [> Compiled scripts (../src/script.c)<] */
+int script_run(const char *path);
+
+
+/* [> Memory introspection (../src/meminfo.c)<] */
+void meminfo_collect(meminfo *mi);
+
+void meminfo_print(meminfo *mi);
+
+void meminfo_json(meminfo *mi);
+
+
+/* [> Deadlines of commands (../src/timeout.c)<] */
+int parse_duration(const char *str, uint64_t *ns);
+
+int parse_signal(const char *str);
+
+void deadline_init(deadline *d);
+
+int deadline_arm(deadline *d, uint64_t ns, int sig, uint64_t grace);
+
+void deadline_clear(deadline *d);
+
+int deadline_pollfds(struct pollfd *fds);
+
+void deadline_events(struct pollfd *fds, int n);
+
+int timeout_run(char **param, int no_params, uint64_t ns, int sig, uint64_t grace);
+
+
+/* [> Variables and arithmetic (../src/var.c)<] */
+size_t var_name_len(const char *str);
+
+const char *var_get(const char *name, size_t len);
+
+int var_set(const char *name, size_t len, const char *value);
+
+int var_assign(char **param);
+
+int arith_eval(const char *expr, int64_t *result);
+
+
+/* [> Zero-copy fan-out (../src/fanout.c)<] */
+int fanout_index(char **param);
+
+int fanout_run(char **param, int no_params);
+
+
+/* [> Command substitution (../src/subst.c)<] */
+int subst_needed(const char *str);
+
+int subst_split(char *str, char ***saveptr);
+
+
+/* [> Functions for shared history (../src/shist.c)<] */
+int shist_open(const char *name);
+
+void shist_close();
+
+void shist_append(const char *line, size_t len);
+
+int shist_read(uint64_t seq, shist_entry *out);
+
+void shist_print(pid_t session);
+
+
+/* [> Functions for job placement (../src/place.c) <] */
+int parse_cpulist(const char *str, cpu_set_t *set);
+
+void format_cpulist(cpu_set_t *set, char *buf, size_t len);
+
+int node_cpus(int node, cpu_set_t *set);
+
+int resolve_placement(placement *policy, placement *out);
+
+int apply_placement(pid_t pid, placement *pl);
+
+void release_placement(pid_t pid, placement *pl);
+
+void format_placement(placement *pl, char *buf, size_t len);
+
+void init_placement(placement *pl);
+
+int parse_placement_opt(char opt, char *val, placement *pl);
+
+int job_last_cpu(pid_t pid);
+
+
+/* [> Event loop functions (../src/ev.c) <] */
+void sigchld_handler(int sig);
+
+void ev_init();
+
+void reap_jobs();
+
+int ev_poll(int fd, int timeout);
+
+int wait_fg(pid_t pid);
+
+int read_line(char *line, size_t len);
+
+
+/* [> Functions for the background job queue (../src/jq.c) <] */
+int qjob_cmp(const void *a, const void *b);
+
+int queue_job(char **param, placement *policy);
+
+qjob *dequeue_job();
+
+double read_pressure(const char *path);
+
+int can_admit(int *pressure);
+
+void admit_jobs();
+
+int admit_timeout();
 
 
 /* [> Functions for history bitmap (../src/bm.c) <] */
@@ -152,6 +963,8 @@ int test_n_free_bit(unsigned char *bitmap, int n);
 
 int get_free_bit(unsigned char *bitmap);
 
+int get_free_run(unsigned char *bitmap, int n);
+
 void set_bit(unsigned char *bitmap, int i);
 
 void free_bit(unsigned char *bitmap, int i);
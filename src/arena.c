@@ -0,0 +1,235 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* Allocation counters, also counts before the shell struct exists */
+alloc_stats a_stats;
+
+
+/*
+ * Function: mysh_malloc
+ * --------------------
+ *  malloc that is counted in the allocation counters. All heap allocations of the shell
+ *  go through here, so steady state command execution can be checked for zero mallocs.
+ *
+ *  size: Number of bytes
+ *
+ *  returns: Pointer to the memory, NULL on failure.
+ */
+void *mysh_malloc(size_t size){
+	a_stats.mallocs++;
+	return malloc(size);
+}
+
+
+/*
+ * Function: mysh_realloc
+ * --------------------
+ *  realloc that is counted in the allocation counters, like mysh_malloc.
+ *
+ *  *ptr: Memory to resize, NULL to allocate
+ *  size: Number of bytes
+ *
+ *  returns: Pointer to the memory, NULL on failure (ptr is then unchanged).
+ */
+void *mysh_realloc(void *ptr, size_t size){
+	a_stats.mallocs++;
+	return realloc(ptr, size);
+}
+
+
+/*
+ * Function: arena_alloc
+ * --------------------
+ *  Bump pointer allocation from an arena. A new chunk is only allocated when the
+ *  allocation does not fit in any of the chunks kept from earlier commands.
+ *
+ *  *a: Arena
+ *  size: Number of bytes
+ *
+ *  returns: Pointer to 16 byte aligned memory, NULL on failure.
+ */
+void *arena_alloc(arena *a, size_t size){
+
+	size = (size + 15) & ~(size_t)15;
+
+	/* Move on to the next kept chunk when the current one is full */
+	while(a->cur != NULL && a->cur->used + size > a->cur->size){
+		if(a->cur->next == NULL){
+			break;
+		}
+		a->cur = a->cur->next;
+	}
+
+	if(a->cur == NULL || a->cur->used + size > a->cur->size){
+		size_t chunk_size = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+		arena_chunk *c = (arena_chunk*)mysh_malloc(sizeof(arena_chunk) + chunk_size);
+		if(c == NULL){
+			return NULL;
+		}
+		c->next = NULL;
+		c->size = chunk_size;
+		c->used = 0;
+		if(a->cur == NULL){
+			a->head = c;
+		}
+		else{
+			a->cur->next = c;
+		}
+		a->cur = c;
+		a_stats.arena_size += chunk_size;
+	}
+
+	void *ret = a->cur->data + a->cur->used;
+	a->cur->used += size;
+
+	a_stats.arena_allocs++;
+	a_stats.arena_used += size;
+	if(a_stats.arena_used > a_stats.arena_high){
+		a_stats.arena_high = a_stats.arena_used;
+	}
+	return ret;
+}
+
+
+/*
+ * Function: arena_strndup
+ * --------------------
+ *  Copies a string into an arena.
+ *
+ *  *a: Arena
+ *  *str: String to copy
+ *  len: Number of bytes to copy
+ *
+ *  returns: NUL terminated copy, NULL on failure.
+ */
+char *arena_strndup(arena *a, const char *str, size_t len){
+
+	char *ret = arena_alloc(a, len + 1);
+	if(ret != NULL){
+		memcpy(ret, str, len);
+		ret[len] = '\0';
+	}
+	return ret;
+}
+
+
+/*
+ * Function: arena_map
+ * --------------------
+ *  Maps a file private and writable until the arena is reset, for buffers too large to
+ *  keep in the arena's chunks after the command.
+ *
+ *  *a: Arena
+ *  fd: File to map
+ *  size: Number of bytes, at most the size of the file
+ *
+ *  returns: Pointer to the mapping, NULL on failure.
+ */
+void *arena_map(arena *a, int fd, size_t size){
+
+	arena_mapping *map = arena_alloc(a, sizeof(arena_mapping));
+	if(map == NULL){
+		return NULL;
+	}
+	map->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(map->addr == MAP_FAILED){
+		return NULL;
+	}
+	map->size = size;
+	map->next = a->maps;
+	a->maps = map;
+	return map->addr;
+}
+
+
+/*
+ * Function: arena_reset
+ * --------------------
+ *  Frees everything allocated from an arena at once. The chunks are kept for reuse,
+ *  mappings are removed.
+ *
+ *  *a: Arena
+ */
+void arena_reset(arena *a){
+
+	for(arena_mapping *map = a->maps; map != NULL; map = map->next){
+		munmap(map->addr, map->size);
+	}
+	a->maps = NULL;
+
+	for(arena_chunk *c = a->head; c != NULL; c = c->next){
+		c->used = 0;
+	}
+	a->cur = a->head;
+
+	a_stats.arena_resets++;
+	a_stats.arena_used = 0;
+}
+
+
+/*
+ * Function: pool_init
+ * --------------------
+ *  Initializes a pool of fixed size objects.
+ *
+ *  *p: Pool
+ *  size: Size of each object
+ */
+void pool_init(pool *p, size_t size){
+
+	p->size = (size + 15) & ~(size_t)15;
+	p->free = NULL;
+	p->no_used = 0;
+	p->no_slabs = 0;
+}
+
+
+/*
+ * Function: pool_alloc
+ * --------------------
+ *  Allocates an object from a pool. Freed objects are reused before a new slab of
+ *  POOL_SLAB objects is allocated. Slabs are never returned.
+ *
+ *  *p: Pool
+ *
+ *  returns: Pointer to the object, NULL on failure.
+ */
+void *pool_alloc(pool *p){
+
+	if(p->free == NULL){
+		char *slab = mysh_malloc(p->size * POOL_SLAB);
+		if(slab == NULL){
+			return NULL;
+		}
+		for(int i = POOL_SLAB - 1; i >= 0; i--){
+			*(void**)(slab + i*p->size) = p->free;
+			p->free = slab + i*p->size;
+		}
+		p->no_slabs++;
+	}
+
+	void *ret = p->free;
+	p->free = *(void**)ret;
+	p->no_used++;
+	a_stats.pool_allocs++;
+	return ret;
+}
+
+
+/*
+ * Function: pool_free
+ * --------------------
+ *  Returns an object to its pool.
+ *
+ *  *p: Pool
+ *  *obj: Object from the pool
+ */
+void pool_free(pool *p, void *obj){
+
+	*(void**)obj = p->free;
+	p->free = obj;
+	p->no_used--;
+	a_stats.pool_frees++;
+}
@@ -0,0 +1,196 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+
+/*
+ * Function: arg_limit
+ * --------------------
+ *  Bytes of arguments execve accepts: ARG_MAX less headroom, as in xargs. Commands are
+ *  run with an empty environment, so the arguments get all of it.
+ *
+ *  returns: Limit in bytes, counting each argument's string and pointer.
+ */
+size_t arg_limit(){
+
+	long max = sysconf(_SC_ARG_MAX);
+	if(max <= BATCH_HEADROOM){
+		max = _POSIX_ARG_MAX;
+	}
+	return max - BATCH_HEADROOM;
+}
+
+
+/*
+ * Function: arg_size
+ * --------------------
+ *  Space an argument takes at execve.
+ */
+static size_t arg_size(const char *arg){
+	return strlen(arg) + 1 + sizeof(char*);
+}
+
+
+/*
+ * Function: batch_needed
+ * --------------------
+ *  Checks if a command has to be split to run: batching is on, arguments were expanded
+ *  from globs and they do not fit in one execve.
+ *
+ *  **param: Command and arguments
+ *  no_params: Number of arguments
+ *
+ *  returns: 1 if the command has to be split, 0 if not.
+ */
+int batch_needed(char **param, int no_params){
+
+	if(!m->batch_on || m->glob_first == -1){
+		return FALSE;
+	}
+
+	size_t size = sizeof(char*);
+	for(int i = 0; i < no_params; i++){
+		size += arg_size(param[i]);
+	}
+	return size > arg_limit();
+}
+
+
+/*
+ * Function: batch_run
+ * --------------------
+ *  Runs a command split into invocations that each fit in an execve, like xargs. The
+ *  arguments expanded from globs are split, the arguments before and after them are
+ *  given to every invocation, so 'cp *.c dir/' keeps 'dir/' last. Up to batch_jobs
+ *  invocations run at once.
+ *
+ *  The combined exit status is 0 if all succeeded, 123 if any exited with 1-125, 124
+ *  if any exited with 255 and 125 if any was killed, as in xargs.
+ *
+ *  **param: Command and arguments
+ *  no_params: Number of arguments
+ *
+ *  returns: 0 on success, -1 on fork error.
+ */
+int batch_run(char **param, int no_params){
+
+	size_t limit = arg_limit();
+	int first = m->glob_first;
+	int last = m->glob_last;
+
+	/* Arguments in every invocation */
+	size_t fixed = sizeof(char*);
+	for(int i = 0; i < no_params; i++){
+		if(i < first || i > last){
+			fixed += arg_size(param[i]);
+		}
+	}
+	if(fixed >= limit){
+		fprintf(stderr, "mysh: %s: Argument list too long\n", param[0]);
+		return 0;
+	}
+
+	char **argv = arena_alloc(&m->arena, (no_params + 1) * sizeof(char*));
+	if(argv == NULL){
+		fprintf(stderr, "ERROR: Failed to allocate memory\n");
+		return 0;
+	}
+	memcpy(argv, param, first * sizeof(char*));
+
+	int next = first;
+	int no_batches = 0;
+	int ret = 0;
+	m->no_batch_running = 0;
+	m->batch_code = 0;
+	m->batch_failed = 0;
+
+	while(next <= last || m->no_batch_running){
+		/* Wait for an invocation to exit */
+		if(next > last || m->no_batch_running >= m->batch_jobs || ret == -1){
+			if(m->no_batch_running == 0){
+				break;
+			}
+			ev_poll(-1, admit_timeout());
+			continue;
+		}
+
+		/* As many arguments as fit, at least one */
+		int argc = first;
+		size_t size = fixed;
+		while(next <= last && (argc == first || size + arg_size(param[next]) <= limit)){
+			size += arg_size(param[next]);
+			argv[argc++] = param[next++];
+		}
+		for(int i = last + 1; i < no_params; i++){
+			argv[argc++] = param[i];
+		}
+		argv[argc] = NULL;
+
+		pid_t pid = fork();
+		if(pid == 0){
+			exec_command(argv[0], argv);
+			exit(EXIT_FAILURE);
+		}
+		else if(pid < 0){
+			fprintf(stderr, "ERROR: Unable to fork");
+			ret = -1;
+			continue;
+		}
+		m->batch_pids[m->no_batch_running++] = pid;
+		no_batches++;
+	}
+
+	m->fg_status = m->batch_code << 8;
+	if(m->batch_failed){
+		fprintf(stderr, "mysh: %s: %d of %d invocations failed (status %d)\n", param[0],
+				m->batch_failed, no_batches, m->batch_code);
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: Batch: %d arguments in %d invocations, limit %zu bytes\n",
+			last - first + 1, no_batches, limit);
+#endif
+
+	return ret;
+}
+
+
+/*
+ * Function: batch_reap
+ * --------------------
+ *  Records the exit of an invocation started by batch_run, or a stage of a fan-out.
+ *
+ *  pid: Pid of the exited child
+ *  status: Wait status
+ *
+ *  returns: 1 if the child was an invocation, 0 if not.
+ */
+int batch_reap(pid_t pid, int status){
+
+	for(int i = 0; i < m->no_batch_running; i++){
+		if(m->batch_pids[i] != pid){
+			continue;
+		}
+		m->batch_pids[i] = m->batch_pids[--m->no_batch_running];
+
+		int code = 0;
+		if(WIFSIGNALED(status)){
+			code = 125;
+		}
+		else if(WEXITSTATUS(status) == 255){
+			code = 124;
+		}
+		else if(WEXITSTATUS(status) != 0){
+			code = 123;
+		}
+		if(code){
+			m->batch_failed++;
+		}
+		if(code > m->batch_code){
+			m->batch_code = code;
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
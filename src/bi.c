@@ -79,8 +79,9 @@ int mysh_type(char **args) {
  *
  *   **args: Se usage
  *
- *   usage: h [-d <i>] <i>
+ *   usage: h [-d <i>] [-a [session]] <i>
  *   	-d i: Delete history input 'i'
+ *   	-a: Print shared history of all sessions, or only 'session' (pid)
  *   	i: Run history input i
  *
  *   returns: 0 on success, 1 on usage error.
@@ -88,90 +89,80 @@ int mysh_type(char **args) {
 int mysh_h(char **args){
 
 	/* Usage */
-	char *usage = "usage: h [-d <i>] <i>\n 	-d i: Delete history input 'i'\n 	i: Run history input i\n";
+	char *usage = "usage: h [-d <i>] [-a [session]] <i>\n 	-d i: Delete history input 'i'\n"
+		" 	-a: Print shared history of all sessions, or only 'session' (pid)\n 	i: Run history input i\n";
 	int argc = 0;
 	for(int i = 0;args[i]; i++){
 		argc++;
 	}
 
-	/* History blocks array */
-	char *cmds[MAX_BLOCKS];
-	/* Head of metadatblock linked list */
-	md *current = m->head;
+	/* Numbers are as listed before this command was saved */
+	int offset = m->hist_saved ? 1 : 0;
 	/* History index */
-	int  index = 0;
-
-	/* Get commands */
-	while(current != NULL){
-		char line[INPUT_BUFSIZE];
-		line[0] = '\0';
-		for(int i = 0; current->d_index[i] >= 0; i++){
-			strncat(line, &h_m.hist[current->d_index[i]*8], 8);
-		}
-		cmds[++index] = strdup(line);
-		current = current->next;
-	}
+	int index = h_m.no_md;
 
-	/* Print history */
+	/* Print history, oldest first, straight from the datablocks */
 	if(argc == 1){
+		struct iovec iov[IOV_MAX];
+		char nums[IOV_MAX / 4][8];
+		int no_iov = 0;
+		int no_nums = 0;
+
 		printf("\nHistory list of the last %d commands:\n", index);
+		fflush(stdout);
 		for(int i = index; i > 0; i--){
-			printf("%3d: %s\n", i, cmds[i]);
-			free(cmds[i]);
+			/* Flush when the next input might not fit */
+			if(no_iov + HIST_MAX_DEPTH + 3 > IOV_MAX || no_nums == IOV_MAX / 4){
+				writev(STDOUT_FILENO, iov, no_iov);
+				no_iov = 0;
+				no_nums = 0;
+			}
+			iov[no_iov].iov_base = nums[no_nums];
+			iov[no_iov++].iov_len = snprintf(nums[no_nums++], 8, "%3d: ", i);
+			no_iov += hist_view(i - 1, &iov[no_iov]);
+			iov[no_iov].iov_base = "\n";
+			iov[no_iov++].iov_len = 1;
 		}
-		return 1;
+		writev(STDOUT_FILENO, iov, no_iov);
+		return 0;
+	}
+
+	/* Print shared history */
+	if((argc == 2 || argc == 3) && (strcmp(args[1], "-a") == 0)){
+		if(m->shist == NULL){
+			printf("mysh: h: shared history is off, set MYSH_SHARED_HISTORY\n");
+			return 1;
+		}
+		shist_print(argc == 3 ? atoi(args[2]) : 0);
+		return 0;
 	}
 
 	/* Delete history input */
 	if(argc == 3 && (strcmp(args[1], "-d") == 0)){
 		int i = atoi(args[2]);
-		if((i > 0) && (i < index)){
-			/* Get metadatblock */
-			md *delete_me = remove_n(m->head, i);
-			/* Clear bits and free memory */
-			for(int j = 0; delete_me->d_index[j] >= 0; j++){
-				free_bit(h_m.bm, delete_me->d_index[j]);
-				int hist_index = delete_me->d_index[j]*BLOCK_SIZE;
-				memset(&h_m.hist[hist_index], '\0', BLOCK_SIZE);
-				delete_me->next = NULL;
-			}
-
-			/* Free cmds */
-			for(int i = index; i > 0; i--){
-				free(cmds[i]);
-			}
-			index--;
-			free(delete_me);
-#ifdef DEBUG
-			debug_bitmap(h_m.bm);
-			debug_datablocks(h_m.hist);
-#endif
-			return 1;
+		if((i > 0) && (i <= index - offset)){
+			hist_remove(i - 1 + offset);
+			return 0;
 		}
 	}
 
-	/* Run history input */
+	/* Run history input, split like a typed line from its own copy of the view */
 	if(argc == 2){
-		int ret = 0;
 		int i = atoi(args[1]);
 		/* Usage control */
-		if((i > 0) && (i < index)){
-			char *param[PARAMS_BUFSIZE];
-			int no_params = strtok_param(cmds[i+1], param);
-			ret = param_parser(param, no_params);
-			/* Free cmds */
-			for(int i = index; i > 0; i--){
-				free(cmds[i]);
+		if((i > 0) && (i <= index - offset)){
+			char line[INPUT_BUFSIZE];
+			char **param;
+			hist_decode(i - 1 + offset, line);
+			int no_params = split_line(line, &param);
+			if(no_params == -1){
+				fprintf(stderr, "ERROR: Failed to allocate memory\n");
+				return 1;
 			}
-			return ret;
+			return param_parser(param, no_params);
 		}
 	}
 
-	/* Free cmds */
-	for(int i = index; i > 0; i--){
-		free(cmds[i]);
-	}
-
 	printf("%s", usage);
 	return 1;
 }
@@ -200,9 +191,27 @@ int mysh_jobs(char **args){
 	}
 
 	for(int i = 0 ; i < m->no_jobs; i++){
-		printf("\nPid 			= %d", m->jobs[i].pid);
-	    printf("\nCommand line 		= %s\n", m->jobs[i].cmd);
+		char place[PATH_BUFSIZE + INPUT_BUFSIZE];
+		format_placement(&m->jobs[i]->place, place, sizeof(place));
+		printf("\nPid 			= %d", m->jobs[i]->pid);
+	    printf("\nCommand line 		= %s", m->jobs[i]->cmd);
+	    printf("\nPlacement 		= %s", place);
+	    printf("\nLast cpu 		= %d\n", job_last_cpu(m->jobs[i]->pid));
 	}
+
+	/* Queued jobs in admission order */
+	qjob **queued = arena_alloc(&m->arena, m->no_queued * sizeof(qjob*) + 1);
+	if(queued == NULL){
+		return 1;
+	}
+	memcpy(queued, m->queue, m->no_queued * sizeof(qjob*));
+	qsort(queued, m->no_queued, sizeof(qjob*), &qjob_cmp);
+	for(int i = 0; i < m->no_queued; i++){
+		printf("\nStatus 			= queued (q%lu, %d in line)", queued[i]->seq + 1, i + 1);
+	    printf("\nCommand line 		= %s", queued[i]->cmd);
+	    printf("\nPriority 		= %d\n", queued[i]->prio);
+	}
+
 	return 0;
 }
 
@@ -238,7 +247,7 @@ int mysh_kill(char **args){
 
 	/* Find pid */
 	for(int i = 0 ;i < m->no_jobs; i++){
-		if(m->jobs[i].pid == kill_pid){
+		if(m->jobs[i]->pid == kill_pid){
 			/* Kill */
 			if(kill(kill_pid, SIGKILL) == -1){
 				fprintf(stderr, "ERROR: Could not kill (%d)\n", kill_pid);
@@ -255,3 +264,476 @@ int mysh_kill(char **args){
 	printf("bash: kill: (%d) - No such process\n", kill_pid);
 	return -1;
 }
+
+
+/*
+ * Function: mysh_place
+ * ----------------------------
+ *   Shows or sets the placement policy for background jobs. Without a pid the default
+ *   policy for new jobs is changed, with a pid the policy is applied to that running job.
+ *
+ *   **args: Se usage
+ *
+ *   usage: place [-c <cpus|rr[:cpus]>] [-m <node>] [-n <nice>] [-i <class[:level]>] [-g <cgroup>] [pid]
+ *   	-c: Cpu list, or round-robin one cpu per job from list/all cpus
+ *   	-m: NUMA node to bind cpus and memory to, not for a running job
+ *   	-n: Nice value
+ *   	-i: IO priority class (rt, be, idle) and level (0-7)
+ *   	-g: cgroup-v2 directory to create a leaf per job in
+ *   	Any value can be 'none' to inherit from the shell.
+ *
+ *   returns: 0 on success, 1 on usage error or failure.
+ */
+int mysh_place(char **args){
+
+	/* Usage */
+	char *usage = "usage: place [-c <cpus|rr[:cpus]>] [-m <node>] [-n <nice>] [-i <class[:level]>] [-g <cgroup>] [pid]\n"
+		" 	-c: Cpu list, or round-robin one cpu per job from list/all cpus\n"
+		" 	-m: NUMA node to bind cpus and memory to, not for a running job\n"
+		" 	-n: Nice value\n"
+		" 	-i: IO priority class (rt, be, idle) and level (0-7)\n"
+		" 	-g: cgroup-v2 directory to create a leaf per job in\n"
+		" 	Any value can be 'none' to inherit from the shell.\n";
+	int argc = 0;
+	for(int i = 0;args[i]; i++){
+		argc++;
+	}
+
+	/* Find target: default policy or a running job */
+	job *target = NULL;
+	int last = argc;
+	if(argc % 2 == 0){
+		if(args[argc - 1][0] == '-'){
+			printf("%s", usage);
+			return 1;
+		}
+		pid_t pid = atoi(args[argc - 1]);
+		for(int i = 0; i < m->no_jobs; i++){
+			if(m->jobs[i]->pid == pid){
+				target = m->jobs[i];
+			}
+		}
+		if(target == NULL){
+			printf("mysh: place: (%s) - No such job\n", args[argc - 1]);
+			return 1;
+		}
+		last = argc - 1;
+	}
+
+	placement pl = target ? target->place : m->place;
+
+	/* Parse options */
+	for(int i = 1; i < last; i += 2){
+		if(args[i][0] != '-' || strlen(args[i]) != 2 || parse_placement_opt(args[i][1], args[i+1], &pl) == -1){
+			printf("%s", usage);
+			return 1;
+		}
+	}
+
+	/* Print policy */
+	if(last == 1){
+		char place[PATH_BUFSIZE + INPUT_BUFSIZE];
+		format_placement(&pl, place, sizeof(place));
+		printf("%s\n", place);
+		return 0;
+	}
+
+	/* Set default policy */
+	if(target == NULL){
+		m->place = pl;
+		return 0;
+	}
+
+	/* Memory policy is only set by the process itself, when a job starts */
+	if(pl.node != target->place.node){
+		printf("mysh: place: -m can not be changed for a running job\n");
+		return 1;
+	}
+
+	/* Apply to running job, cgroup is only created if it changed */
+	placement resolved;
+	if(resolve_placement(&pl, &resolved) == -1){
+		printf("mysh: place: no usable cpu in placement policy\n");
+		return 1;
+	}
+	int moved = strcmp(target->place.cgroup, resolved.cgroup) != 0;
+	if(!moved){
+		resolved.cgroup[0] = '\0';
+	}
+	int ret = apply_placement(target->pid, &resolved);
+
+	/* The old leaf is released only once the job is out of it */
+	if(moved && resolved.cgroup[0]){
+		release_placement(target->pid, &target->place);
+	}
+	else{
+		strcpy(resolved.cgroup, target->place.cgroup);
+	}
+	target->place = resolved;
+
+	return ret ? 1 : 0;
+}
+
+/*
+ * Function: mysh_queue
+ * ----------------------------
+ *   Shows or sets the admission queue for background jobs. When on, '&' jobs are only
+ *   started while the number of running jobs and the cpu and memory pressure stay below
+ *   the thresholds. The rest wait in priority order (nice value of the placement policy).
+ *
+ *   **args: Se usage
+ *
+ *   usage: queue [on|off] [-j <jobs>] [-c <pressure>] [-m <pressure>]
+ *   	on/off: Queue background jobs or start them at once
+ *   	-j: Max running background jobs, 0 for no limit
+ *   	-c: Max cpu pressure (some avg10 %), 'none' for no limit
+ *   	-m: Max memory pressure (some avg10 %), 'none' for no limit
+ *
+ *   returns: 0 on success, 1 on usage error.
+ */
+int mysh_queue(char **args){
+
+	/* Usage */
+	char *usage = "usage: queue [on|off] [-j <jobs>] [-c <pressure>] [-m <pressure>]\n"
+		" 	on/off: Queue background jobs or start them at once\n"
+		" 	-j: Max running background jobs, 0 for no limit\n"
+		" 	-c: Max cpu pressure (some avg10 %), 'none' for no limit\n"
+		" 	-m: Max memory pressure (some avg10 %), 'none' for no limit\n";
+	int argc = 0;
+	for(int i = 0;args[i]; i++){
+		argc++;
+	}
+
+	/* Print settings */
+	if(argc == 1){
+		printf("Queue 			= %s\n", m->queue_on ? "on" : "off");
+		printf("Max jobs 		= %ld (running %ld, queued %ld)\n", m->max_running, m->no_jobs, m->no_queued);
+		char *psi[] = { "/proc/pressure/cpu", "/proc/pressure/memory" };
+		char *names[] = { "Max cpu pressure 	= ", "Max memory pressure 	= " };
+		double limits[] = { m->max_cpu_psi, m->max_mem_psi };
+		for(int i = 0; i < 2; i++){
+			printf("%s", names[i]);
+			if(limits[i] < 0){
+				printf("none");
+			}
+			else{
+				printf("%.2f", limits[i]);
+			}
+			printf(" (now %.2f)\n", read_pressure(psi[i]));
+		}
+		return 0;
+	}
+
+	int i = 1;
+	int on = m->queue_on;
+	size_t max_running = m->max_running;
+	double max_cpu_psi = m->max_cpu_psi;
+	double max_mem_psi = m->max_mem_psi;
+
+	if(strcmp(args[i], "on") == 0 || strcmp(args[i], "off") == 0){
+		on = (strcmp(args[i++], "on") == 0);
+	}
+
+	/* Parse thresholds */
+	for(; i < argc; i += 2){
+		char *end;
+		if(i + 1 >= argc){
+			printf("%s", usage);
+			return 1;
+		}
+		if(strcmp(args[i], "-j") == 0){
+			long n = strtol(args[i+1], &end, 10);
+			if(*end || n < 0){
+				printf("%s", usage);
+				return 1;
+			}
+			max_running = n;
+		}
+		else if(strcmp(args[i], "-c") == 0 || strcmp(args[i], "-m") == 0){
+			double limit = -1;
+			if(strcmp(args[i+1], "none") != 0){
+				limit = strtod(args[i+1], &end);
+				if(*end || limit < 0){
+					printf("%s", usage);
+					return 1;
+				}
+			}
+			if(args[i][1] == 'c'){
+				max_cpu_psi = limit;
+			}
+			else{
+				max_mem_psi = limit;
+			}
+		}
+		else{
+			printf("%s", usage);
+			return 1;
+		}
+	}
+
+	m->queue_on = on;
+	m->max_running = max_running;
+	m->max_cpu_psi = max_cpu_psi;
+	m->max_mem_psi = max_mem_psi;
+
+	/* Looser limits may admit waiting jobs */
+	admit_jobs();
+
+	return 0;
+}
+
+/*
+ * Function: mysh_stats
+ * ----------------------------
+ *   Prints or controls command latency stats. Latencies are recorded per command for the
+ *   phases parse (tokenizing), launch (fork), run (start to exit) and wait (shell blocked).
+ *
+ *   **args: Se usage
+ *
+ *   usage: stats [on|off|reset] [-w <file>]
+ *   	on/off: Start or stop recording
+ *   	reset: Remove recorded stats
+ *   	-w file: Write stats to file, JSON if it ends in .json, else Prometheus text format
+ *
+ *   returns: 0 on success, 1 on usage error or write error.
+ */
+int mysh_stats(char **args){
+
+	/* Usage */
+	char *usage = "usage: stats [on|off|reset] [-w <file>]\n"
+		" 	on/off: Start or stop recording\n"
+		" 	reset: Remove recorded stats\n"
+		" 	-w file: Write stats to file, JSON if it ends in .json, else Prometheus text format\n";
+	int argc = 0;
+	for(int i = 0;args[i]; i++){
+		argc++;
+	}
+
+	/* Print stats */
+	if(argc == 1){
+		if(!m->stats_on){
+			printf("Stats are off, turn on with 'stats on'\n");
+		}
+		stats_print();
+		return 0;
+	}
+
+	if(argc == 2 && strcmp(args[1], "on") == 0){
+		m->stats_on = TRUE;
+		return 0;
+	}
+	if(argc == 2 && strcmp(args[1], "off") == 0){
+		m->stats_on = FALSE;
+		return 0;
+	}
+	if(argc == 2 && strcmp(args[1], "reset") == 0){
+		stats_reset();
+		return 0;
+	}
+	if(argc == 3 && strcmp(args[1], "-w") == 0){
+		return stats_write(args[2]) ? 1 : 0;
+	}
+
+	printf("%s", usage);
+	return 1;
+}
+
+/*
+ * Function: mysh_batch
+ * ----------------------------
+ *   Shows or sets argument batching. When on, a command whose arguments expanded from
+ *   globs do not fit in one execve is run several times, each with as many of them as
+ *   fit, like xargs.
+ *
+ *   **args: Se usage
+ *
+ *   usage: batch [on|off] [-j <jobs>]
+ *   	on/off: Split commands with too many arguments or fail with E2BIG
+ *   	-j: Max invocations running at once, 1 to run them one after another
+ *
+ *   returns: 0 on success, 1 on usage error.
+ */
+int mysh_batch(char **args){
+
+	/* Usage */
+	char *usage = "usage: batch [on|off] [-j <jobs>]\n"
+		" 	on/off: Split commands with too many arguments or fail with E2BIG\n"
+		" 	-j: Max invocations running at once, 1 to run them one after another\n";
+	int argc = 0;
+	for(int i = 0;args[i]; i++){
+		argc++;
+	}
+
+	/* Print settings */
+	if(argc == 1){
+		printf("Batching 		= %s\n", m->batch_on ? "on" : "off");
+		printf("Parallel 		= %d\n", m->batch_jobs);
+		printf("Argument limit 		= %zu bytes\n", arg_limit());
+		return 0;
+	}
+
+	int i = 1;
+	int on = m->batch_on;
+	int jobs = m->batch_jobs;
+
+	if(strcmp(args[i], "on") == 0 || strcmp(args[i], "off") == 0){
+		on = (strcmp(args[i++], "on") == 0);
+	}
+
+	for(; i < argc; i += 2){
+		char *end;
+		long n = (i + 1 < argc) ? strtol(args[i+1], &end, 10) : 0;
+		if(strcmp(args[i], "-j") != 0 || i + 1 >= argc || *end || n < 1 || n > BATCH_MAX_JOBS){
+			printf("%s", usage);
+			return 1;
+		}
+		jobs = n;
+	}
+
+	m->batch_on = on;
+	m->batch_jobs = jobs;
+	return 0;
+}
+
+
+/*
+ * Function: mysh_output
+ * ----------------------------
+ *   Shows or sets where background jobs started from now on write their output. When
+ *   multiplexed, stdout and stderr of each job go through a pipe the shell reads, so
+ *   lines of concurrent jobs are never mixed.
+ *
+ *   **args: Se usage
+ *
+ *   usage: output [off|tag|group]
+ *   	off: Jobs write straight to the terminal
+ *   	tag: Each complete line is written with a '[%n pid] ' prefix
+ *   	group: All output of a job is written when it ends, under a '[%n pid]' line
+ *
+ *   returns: 0 on success, 1 on usage error.
+ */
+int mysh_output(char **args){
+
+	/* Usage */
+	char *usage = "usage: output [off|tag|group]\n"
+		" 	off: Jobs write straight to the terminal\n"
+		" 	tag: Each complete line is written with a '[%n pid] ' prefix\n"
+		" 	group: All output of a job is written when it ends, under a '[%n pid]' line\n";
+	char *modes[] = { "off", "tag", "group" };
+	int argc = 0;
+	for(int i = 0;args[i]; i++){
+		argc++;
+	}
+
+	/* Print setting */
+	if(argc == 1){
+		printf("Output 			= %s\n", modes[m->mux_mode]);
+		return 0;
+	}
+
+	for(int i = 0; argc == 2 && i < 3; i++){
+		if(strcmp(args[1], modes[i]) == 0){
+			m->mux_mode = i;
+			return 0;
+		}
+	}
+
+	printf("%s", usage);
+	return 1;
+}
+
+
+/*
+ * Function: mysh_meminfo
+ * ----------------------------
+ *   Prints the memory use of the shell: history datablocks and their fragmentation, the
+ *   job table, caches, allocator counters and the resident set size.
+ *
+ *   **args: Se usage
+ *
+ *   usage: meminfo [-j]
+ *   	-j: Print as JSON
+ *
+ *   returns: 0 on success, 1 on usage error.
+ */
+int mysh_meminfo(char **args){
+
+	/* Usage */
+	char *usage = "usage: meminfo [-j]\n"
+		" 	-j: Print as JSON\n";
+	int argc = 0;
+	for(int i = 0;args[i]; i++){
+		argc++;
+	}
+
+	if(argc > 2 || (argc == 2 && strcmp(args[1], "-j") != 0)){
+		printf("%s", usage);
+		return 1;
+	}
+
+	meminfo mi;
+	meminfo_collect(&mi);
+	if(argc == 2){
+		meminfo_json(&mi);
+	}
+	else{
+		meminfo_print(&mi);
+	}
+	return 0;
+}
+
+
+/*
+ * Function: mysh_timeout
+ * ----------------------------
+ *   Runs a command with a time limit. When it is reached, the signal is sent to the
+ *   command's process group, and SIGKILL after the grace period if given. Works with '&'.
+ *
+ *   **args: Se usage
+ *
+ *   usage: timeout [-s <signal>] [-k <grace>] <duration> <command> [args] [&]
+ *   	-s: Signal to send first, name or number (default TERM)
+ *   	-k: Send KILL if the command is still running this long after the signal
+ *   	duration, grace: Number with unit s (default), m, h or d. 0 for no limit.
+ *
+ *   returns: 0 on success, 1 on usage error, -1 on fork error.
+ */
+int mysh_timeout(char **args){
+
+	/* Usage */
+	char *usage = "usage: timeout [-s <signal>] [-k <grace>] <duration> <command> [args] [&]\n"
+		" 	-s: Signal to send first, name or number (default TERM)\n"
+		" 	-k: Send KILL if the command is still running this long after the signal\n"
+		" 	duration, grace: Number with unit s (default), m, h or d. 0 for no limit.\n";
+	int argc = 0;
+	for(int i = 0;args[i]; i++){
+		argc++;
+	}
+
+	int sig = SIGTERM;
+	uint64_t grace = 0;
+	uint64_t ns;
+	int i = 1;
+
+	for(; i + 1 < argc && args[i][0] == '-'; i += 2){
+		if(strcmp(args[i], "-s") == 0 && (sig = parse_signal(args[i+1])) != -1){
+			continue;
+		}
+		if(strcmp(args[i], "-k") == 0 && parse_duration(args[i+1], &grace) == 0){
+			continue;
+		}
+		printf("%s", usage);
+		return 1;
+	}
+
+	if(i + 1 >= argc || parse_duration(args[i], &ns) == -1 || strcmp(args[i+1], BG_SIGN) == 0){
+		printf("%s", usage);
+		return 1;
+	}
+	if(builtin_index(args[i+1]) != -1){
+		fprintf(stderr, "mysh: timeout: %s: builtins can not be timed\n", args[i+1]);
+		return 1;
+	}
+
+	return timeout_run(args + i + 1, argc - i - 1, ns, sig, grace);
+}
@@ -46,6 +46,27 @@ int get_free_bit(unsigned char *bitmap){
 }
 
 
+/*
+ * Function: 
+ * --------------------
+ * 	Searches for a run of 'n' consecutive free bits.
+ *
+ *  *bitmap: bitmap to search in
+ *  n: number of bits needed
+ *  returns: index of the first bit in the run, or -1 if there is no such run.
+ */
+int get_free_run(unsigned char *bitmap, int n){
+	int run = 0;
+	for(int i = 0; i < MAX_BLOCKS; i++){
+		run = TestBit(bitmap, i) ? 0 : run + 1;
+		if(run >= n){
+			return i - n + 1;
+		}
+	}
+	return -1;
+}
+
+
 /*
  * Function: 
  * --------------------
@@ -0,0 +1,450 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* Builtin commands */
+extern char *builtins_cmds[];
+
+
+/*
+ * Function: tty_mode
+ * --------------------
+ *  Switches the terminal between raw input, where mysh echoes and edits the line itself,
+ *  and the mode it had when mysh started. Commands are always run in the original mode.
+ *
+ *  raw: TRUE for raw input, FALSE to restore
+ */
+void tty_mode(int raw){
+
+	if(!m->tty){
+		return;
+	}
+
+	struct termios t = m->tty_saved;
+	if(raw){
+		t.c_lflag &= ~(ICANON | ECHO);
+		t.c_cc[VMIN] = 1;
+		t.c_cc[VTIME] = 0;
+	}
+	tcsetattr(STDIN_FILENO, TCSANOW, &t);
+}
+
+
+/*
+ * Function: echo
+ * --------------------
+ *  Writes bytes straight to the terminal.
+ */
+static void echo(const char *str, size_t len){
+	if(write(STDOUT_FILENO, str, len) == -1){
+		/* Nothing to do if the terminal is gone */
+	}
+}
+
+
+/*
+ * Function: line_insert
+ * --------------------
+ *  Appends to the line being edited and echoes it, as much as fits.
+ *
+ *  *line: Line
+ *  *pos: Length of the line
+ *  len: Size of line
+ *  *str: String to append
+ *  n: Length of str
+ */
+static void line_insert(char *line, size_t *pos, size_t len, const char *str, size_t n){
+
+	/* Room for '\n' and '\0' */
+	if(*pos + n + 2 > len){
+		n = len - *pos - 2;
+	}
+	memcpy(line + *pos, str, n);
+	echo(str, n);
+	*pos += n;
+}
+
+
+/*
+ * Function: edit_char
+ * --------------------
+ *  Handles a key when reading from a terminal: printable characters are echoed and
+ *  added, backspace and Ctrl-U erase, Tab completes and Enter ends the line. Escape
+ *  sequences (arrow keys etc.) are skipped.
+ *
+ *  *line: Line being read
+ *  *pos: Length of the line
+ *  len: Size of line
+ *  c: Key
+ *
+ *  returns: 1 when the line is complete, -1 on Ctrl-D on an empty line, 0 otherwise.
+ */
+int edit_char(char *line, size_t *pos, size_t len, char c){
+
+	/* Escape sequence state: 1 after ESC, 2 inside ESC [ */
+	static int esc = 0;
+
+	if(esc){
+		if(esc == 1 && (c == '[' || c == 'O')){
+			esc = 2;
+		}
+		else if(esc != 2 || c < 0x20 || c >= 0x40){
+			esc = 0;
+		}
+		return 0;
+	}
+
+	switch(c){
+		case '\x1b':
+			esc = 1;
+			return 0;
+		case '\r':
+		case '\n':
+			line[(*pos)++] = '\n';
+			echo("\n", 1);
+			return 1;
+		case '\x7f':
+		case '\b':
+			if(*pos > 0){
+				(*pos)--;
+				echo("\b \b", 3);
+			}
+			return 0;
+		case '\x15':
+			while(*pos > 0){
+				(*pos)--;
+				echo("\b \b", 3);
+			}
+			return 0;
+		case '\x04':
+			return *pos ? 0 : -1;
+		case '\t':
+			comp_complete(line, pos, len);
+			return 0;
+	}
+
+	if((unsigned char)c >= 0x20){
+		line_insert(line, pos, len, &c, 1);
+	}
+	return 0;
+}
+
+
+/*
+ * Function: keep_executables
+ * --------------------
+ *  Removes everything but executable files from a listing of a PATH directory.
+ *
+ *  *d: Listing
+ */
+static void keep_executables(dir_list *d){
+
+	int fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int n = 0;
+
+	for(int i = 0; fd != -1 && i < d->no_names; i++){
+		char *name = d->names[i];
+		unsigned char type = name[-1];
+		struct stat st;
+		if((type == DT_REG || type == DT_LNK || type == DT_UNKNOWN) && fstatat(fd, name, &st, 0) == 0 &&
+				S_ISREG(st.st_mode) && (st.st_mode & 0111)){
+			d->names[n++] = name;
+		}
+	}
+	if(fd != -1){
+		close(fd);
+	}
+	d->no_names = n;
+}
+
+
+/*
+ * Function: comp_index
+ * --------------------
+ *  Brings the index of executables up to date with PATH. Each PATH directory has a
+ *  sorted listing of its executables, which is only read again when the directory's
+ *  mtime has changed or PATH names another directory in its place.
+ */
+void comp_index(){
+
+	char *env = getenv("PATH");
+	char path[PATH_BUFSIZE*4];
+	char *state;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "%s", env ? env : "");
+	for(char *dir = strtok_r(path, ":", &state); dir != NULL && n < COMP_PATH_DIRS; dir = strtok_r(NULL, ":", &state)){
+		if(dir_load(&m->pindex[n], dir) == 1){
+			keep_executables(&m->pindex[n]);
+		}
+		n++;
+	}
+	m->no_pindex = n;
+}
+
+
+/*
+ * Function: cand_cmp
+ * --------------------
+ *  qsort compare function for completion candidates.
+ */
+static int cand_cmp(const void *a, const void *b){
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/*
+ * Function: comp_commands
+ * --------------------
+ *  Builtins and executables in PATH starting with a prefix. Each PATH directory's range
+ *  of matches is found by binary search.
+ *
+ *  *word: Prefix
+ *  ***cand: Where to store the candidates, sorted without duplicates, in the arena
+ *
+ *  returns: Number of candidates, -1 if out of memory.
+ */
+static int comp_commands(const char *word, char ***cand){
+
+	size_t len = strlen(word);
+	int lo[COMP_PATH_DIRS];
+	int total = NO_BUILTINS;
+
+	comp_index();
+	for(int i = 0; i < m->no_pindex; i++){
+		dir_list *d = &m->pindex[i];
+		lo[i] = dir_find(d, word, len);
+		for(int j = lo[i]; j < d->no_names && strncmp(d->names[j], word, len) == 0; j++){
+			total++;
+		}
+	}
+
+	char **c = arena_alloc(&m->arena, total * sizeof(char*));
+	int n = 0;
+	if(c == NULL){
+		return -1;
+	}
+
+	for(int i = 0; i < NO_BUILTINS; i++){
+		if(strncmp(builtins_cmds[i], word, len) == 0){
+			c[n++] = builtins_cmds[i];
+		}
+	}
+	for(int i = 0; i < m->no_pindex; i++){
+		dir_list *d = &m->pindex[i];
+		for(int j = lo[i]; j < d->no_names && strncmp(d->names[j], word, len) == 0; j++){
+			c[n++] = d->names[j];
+		}
+	}
+
+	/* The same name in several directories */
+	qsort(c, n, sizeof(char*), &cand_cmp);
+	int unique = 0;
+	for(int i = 0; i < n; i++){
+		if(unique == 0 || strcmp(c[i], c[unique - 1]) != 0){
+			c[unique++] = c[i];
+		}
+	}
+
+	*cand = c;
+	return unique;
+}
+
+
+/*
+ * Function: comp_files
+ * --------------------
+ *  Paths starting with a prefix, from the cached directory listing. Directories get a
+ *  trailing '/', dot files are only included if the name part of the prefix starts
+ *  with '.'.
+ *
+ *  *word: Prefix
+ *  ***cand: Where to store the candidates, sorted, in the arena
+ *
+ *  returns: Number of candidates, -1 if out of memory.
+ */
+static int comp_files(const char *word, char ***cand){
+
+	char *slash = strrchr(word, '/');
+	size_t dir_len = slash ? (size_t)(slash - word + 1) : 0;
+	const char *base = word + dir_len;
+	size_t base_len = strlen(base);
+	char dir[PATH_BUFSIZE];
+
+	if(dir_len >= PATH_BUFSIZE){
+		return 0;
+	}
+	memcpy(dir, word, dir_len);
+	dir[dir_len] = '\0';
+
+	dir_list *d = dir_get(dir);
+	if(d == NULL){
+		return 0;
+	}
+
+	int lo = dir_find(d, base, base_len);
+	int hi = lo;
+	while(hi < d->no_names && strncmp(d->names[hi], base, base_len) == 0){
+		hi++;
+	}
+
+	char **c = arena_alloc(&m->arena, (hi - lo + 1) * sizeof(char*));
+	int n = 0;
+	if(c == NULL){
+		return -1;
+	}
+
+	for(int i = lo; i < hi; i++){
+		char *name = d->names[i];
+		unsigned char type = name[-1];
+		size_t name_len = strlen(name);
+		if((name[0] == '.' && base[0] != '.') || dir_len + name_len + 2 > PATH_BUFSIZE){
+			continue;
+		}
+
+		char *path = arena_alloc(&m->arena, dir_len + name_len + 2);
+		if(path == NULL){
+			return -1;
+		}
+		memcpy(path, dir, dir_len);
+		memcpy(path + dir_len, name, name_len + 1);
+
+		struct stat st;
+		if(type == DT_DIR || ((type == DT_LNK || type == DT_UNKNOWN) && stat(path, &st) == 0 && S_ISDIR(st.st_mode))){
+			strcat(path, "/");
+		}
+		c[n++] = path;
+	}
+
+	*cand = c;
+	return n;
+}
+
+
+/*
+ * Function: comp_jobs
+ * --------------------
+ *  Pids of background jobs starting with a prefix.
+ *
+ *  *word: Prefix
+ *  ***cand: Where to store the candidates, in the arena
+ *
+ *  returns: Number of candidates, -1 if out of memory.
+ */
+static int comp_jobs(const char *word, char ***cand){
+
+	char **c = arena_alloc(&m->arena, (m->no_jobs + 1) * sizeof(char*));
+	int n = 0;
+	if(c == NULL){
+		return -1;
+	}
+
+	for(int i = 0; i < m->no_jobs; i++){
+		char pid[16];
+		int len = snprintf(pid, sizeof(pid), "%d", m->jobs[i]->pid);
+		if(strncmp(pid, word, strlen(word)) == 0){
+			if((c[n++] = arena_strndup(&m->arena, pid, len)) == NULL){
+				return -1;
+			}
+		}
+	}
+
+	*cand = c;
+	return n;
+}
+
+
+/*
+ * Function: comp_complete
+ * --------------------
+ *  Completes the word before the cursor: the first word to a command, an argument of
+ *  kill to a job pid, anything else to a path. A single candidate is inserted in full,
+ *  several are completed to their common prefix, or listed if there is none.
+ *
+ *  *line: Line being read
+ *  *pos: Length of the line
+ *  len: Size of line
+ */
+void comp_complete(char *line, size_t *pos, size_t len){
+
+	uint64_t start_time = stats_now();
+
+	/* Word before the cursor, and the command word */
+	size_t start = *pos;
+	while(start > 0 && line[start - 1] != ' ' && line[start - 1] != '\t'){
+		start--;
+	}
+	size_t first = 0;
+	while(first < start && (line[first] == ' ' || line[first] == '\t')){
+		first++;
+	}
+	char *word = arena_strndup(&m->arena, line + start, *pos - start);
+	char *cmd = arena_strndup(&m->arena, line + first, strcspn(line + first, " \t"));
+	if(word == NULL || cmd == NULL){
+		return;
+	}
+
+	char **cand;
+	int n;
+	size_t show = 0;
+	if(first == start && strchr(word, '/') == NULL){
+		n = comp_commands(word, &cand);
+	}
+	else if(first != start && strcmp(cmd, "kill") == 0){
+		n = comp_jobs(word, &cand);
+	}
+	else{
+		n = comp_files(word, &cand);
+		show = strrchr(word, '/') ? strrchr(word, '/') - word + 1 : 0;
+	}
+
+	if(n <= 0){
+		echo("\a", 1);
+		return;
+	}
+
+	/* Longest common prefix of the candidates */
+	size_t word_len = strlen(word);
+	size_t common = strlen(cand[0]);
+	for(int i = 1; i < n; i++){
+		size_t j = 0;
+		while(j < common && cand[i][j] == cand[0][j]){
+			j++;
+		}
+		common = j;
+	}
+
+	if(n == 1){
+		line_insert(line, pos, len, cand[0] + word_len, common - word_len);
+		if(cand[0][common - 1] != '/'){
+			line_insert(line, pos, len, " ", 1);
+		}
+	}
+	else if(common > word_len){
+		line_insert(line, pos, len, cand[0] + word_len, common - word_len);
+	}
+	else{
+		/* List candidates, then redraw the prompt and line */
+		size_t col = 0;
+		printf("\n");
+		for(int i = 0; i < n && i < COMP_SHOW; i++){
+			size_t w = strlen(cand[i] + show) + 2;
+			if(col && col + w > 80){
+				printf("\n");
+				col = 0;
+			}
+			printf("%s  ", cand[i] + show);
+			col += w;
+		}
+		if(n > COMP_SHOW){
+			printf("\n(%d more)", n - COMP_SHOW);
+		}
+		printf("\n%s%.*s", m->prompt, (int)*pos, line);
+		fflush(stdout);
+	}
+
+	if(start_time){
+		stats_record("<tab>", STAT_RUN, stats_now() - start_time);
+	}
+}
@@ -0,0 +1,238 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* Buffered stdin */
+static char rbuf[PATH_BUFSIZE*4];
+static size_t rpos = 0;
+static size_t rlen = 0;
+
+
+/*
+ * Function: sigchld_handler
+ * --------------------
+ *  Wakes up the event loop when a child changes state. Reaping is done by reap_jobs.
+ */
+void sigchld_handler(int sig){
+	int saved_errno = errno;
+	if(write(m->ev_fd[1], "c", 1) == -1){
+		/* Pipe full, a wakeup is already pending */
+	}
+	errno = saved_errno;
+}
+
+
+/*
+ * Function: ev_init
+ * --------------------
+ *  Creates the self-pipe used to turn SIGCHLD into a pollable event and installs the handler.
+ */
+void ev_init(){
+
+	if(pipe2(m->ev_fd, O_NONBLOCK | O_CLOEXEC) == -1){
+		fprintf(stderr, "ERROR(ev_init): Could not create event pipe\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGCHLD, &sa, NULL) == -1){
+		fprintf(stderr, "ERROR: Could not set SIGCHLD handler\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Function: reap_jobs
+ * --------------------
+ *  Reaps all exited children. The foreground child's status and end time are saved for
+ *  wait_fg, invocations of a split command are counted by batch_reap, finished background
+ *  jobs have their run time recorded and are removed from the job array.
+ */
+void reap_jobs(){
+
+	int status;
+	pid_t pid;
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+		if(pid == m->fg_pid){
+			m->fg_end = stats_now();
+			m->fg_status = status;
+			m->fg_pid = 0;
+			continue;
+		}
+		if(batch_reap(pid, status)){
+			continue;
+		}
+		for(int i = 0; i < m->no_jobs; i++){
+			if(m->jobs[i]->pid == pid && m->jobs[i]->start && m->stats_on){
+				char name[STATS_NAME];
+				size_t len = strcspn(m->jobs[i]->cmd, " ");
+				snprintf(name, sizeof(name), "%.*s", (int)len, m->jobs[i]->cmd);
+				stats_record(name, STAT_RUN, stats_now() - m->jobs[i]->start);
+			}
+		}
+		remove_job(pid);
+	}
+}
+
+
+/*
+ * Function: ev_poll
+ * --------------------
+ *  Waits for 'fd' to become readable while handling child exits and job output: finished
+ *  children are reaped, queued jobs admitted as slots free up, output of background
+ *  jobs is written to the terminal and commands past their deadline are signalled.
+ *
+ *  fd: File descriptor to wait for, -1 to only handle events.
+ *  timeout: Timeout in milliseconds, -1 for none.
+ *
+ *  returns: 1 if fd is readable, 0 on timeout, handled event or interrupt.
+ */
+int ev_poll(int fd, int timeout){
+
+	struct pollfd fds[3 + 2*MAX_JOBS];
+	int nfds = 1;
+	char drain[64];
+
+	fds[0].fd = m->ev_fd[0];
+	fds[0].events = POLLIN;
+	if(fd >= 0){
+		fds[1].fd = fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		nfds++;
+	}
+
+	/* Output pipes of background jobs, and timers of commands run with timeout */
+	int no_out = mux_pollfds(fds + nfds);
+	int no_timers = deadline_pollfds(fds + nfds + no_out);
+
+	int ready = poll(fds, nfds + no_out + no_timers, timeout);
+	if(ready <= 0){
+		/* Timeout: pressure may have dropped */
+		if(ready == 0){
+			admit_jobs();
+		}
+		return 0;
+	}
+
+	/* Job output, before exited jobs are removed */
+	if(no_out){
+		mux_events(fds + nfds, no_out);
+	}
+
+	/* Deadlines, before their process groups can be reaped */
+	if(no_timers){
+		deadline_events(fds + nfds + no_out, no_timers);
+	}
+
+	/* Child state changed */
+	if(fds[0].revents & POLLIN){
+		while(read(m->ev_fd[0], drain, sizeof(drain)) > 0);
+		reap_jobs();
+		admit_jobs();
+	}
+
+	return (fd >= 0) && (fds[1].revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+
+/*
+ * Function: wait_fg
+ * --------------------
+ *  Waits for the foreground child to exit. Background events are handled meanwhile,
+ *  so queued jobs are admitted while the foreground command runs.
+ *
+ *  pid: Pid of the foreground child.
+ *
+ *  returns: Wait status of the child.
+ */
+int wait_fg(pid_t pid){
+
+	m->fg_pid = pid;
+
+	/* The child might have exited before fg_pid was set */
+	reap_jobs();
+
+	while(m->fg_pid == pid){
+		ev_poll(-1, admit_timeout());
+	}
+
+	return m->fg_status;
+}
+
+
+/*
+ * Function: read_line
+ * --------------------
+ *  Reads a line from stdin, handling events while waiting for input. Lines longer than
+ *  the buffer are returned in parts, like fgets. From a terminal, the line is edited
+ *  by mysh in raw mode, with Tab completion.
+ *
+ *  *line: Buffer to store the line in, including the '\n'.
+ *  len: Size of line.
+ *
+ *  returns: Length of the line, 0 on end of input and -1 on error or signal.
+ */
+int read_line(char *line, size_t len){
+
+	size_t pos = 0;
+
+	fflush(stdout);
+	tty_mode(TRUE);
+
+	while(pos < len - 1){
+		/* Refill buffer */
+		if(rpos == rlen){
+			if(!ev_poll(STDIN_FILENO, admit_timeout())){
+				if(m->signal_flag){
+					tty_mode(FALSE);
+					return -1;
+				}
+				continue;
+			}
+			ssize_t n = read(STDIN_FILENO, rbuf, sizeof(rbuf));
+			if(n < 0 && errno == EINTR){
+				continue;
+			}
+			if(n < 0){
+				tty_mode(FALSE);
+				return -1;
+			}
+			if(n == 0){
+				break;
+			}
+			rpos = 0;
+			rlen = n;
+		}
+
+		char c = rbuf[rpos++];
+
+		/* Terminal: edit, echo and complete */
+		if(m->tty){
+			int done = edit_char(line, &pos, len, c);
+			if(done == -1){
+				pos = 0;
+			}
+			if(done){
+				break;
+			}
+			continue;
+		}
+
+		line[pos++] = c;
+		if(c == '\n'){
+			break;
+		}
+	}
+
+	tty_mode(FALSE);
+	line[pos] = '\0';
+	return pos;
+}
@@ -0,0 +1,325 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+
+/*
+ * Function: sigpipe_handler
+ * --------------------
+ *  Turns SIGPIPE into EPIPE while fanning out, so a consumer that exits early only stops
+ *  its own copy. A handler, unlike SIG_IGN, is not inherited by the commands started.
+ */
+static void sigpipe_handler(int sig){
+}
+
+
+/*
+ * Function: fanout_index
+ * --------------------
+ *  Finds the fan-out operator in a command.
+ *
+ *  **param: Command and arguments
+ *
+ *  returns: Index of the first '|>', -1 if none.
+ */
+int fanout_index(char **param){
+
+	for(int i = 0; param[i]; i++){
+		if(strcmp(param[i], FANOUT_SIGN) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Function: fanout_spawn
+ * --------------------
+ *  Starts a stage of a fan-out with stdin or stdout replaced, tracked with the
+ *  invocations of split commands (batch_reap).
+ *
+ *  **args: Command and arguments
+ *  fd: File descriptor to use
+ *  target: Descriptor fd replaces, STDIN_FILENO or STDOUT_FILENO
+ *
+ *  returns: 0 on success, -1 on fork error.
+ */
+static int fanout_spawn(char **args, int fd, int target){
+
+	pid_t pid = fork();
+	if(pid == 0){
+		dup2(fd, target);
+		exec_command(args[0], args);
+		exit(EXIT_FAILURE);
+	}
+	else if(pid < 0){
+		fprintf(stderr, "ERROR: Unable to fork");
+		return -1;
+	}
+	m->batch_pids[m->no_batch_running++] = pid;
+	return 0;
+}
+
+
+/*
+ * Function: fanout_open
+ * --------------------
+ *  Opens a file target of a fan-out: '>file' truncates, '>>file' appends. The file name
+ *  may also be the next word. Appending seeks to the end instead of using O_APPEND,
+ *  which splice does not write to.
+ *
+ *  **args: Target words
+ *
+ *  returns: File descriptor, -1 on error.
+ */
+static int fanout_open(char **args){
+
+	int append = (args[0][1] == '>');
+	char *name = args[0] + 1 + append;
+	if(*name == '\0'){
+		name = args[1];
+	}
+	if(name == NULL){
+		fprintf(stderr, "mysh: %s: missing file name\n", FANOUT_SIGN);
+		return -1;
+	}
+
+	int fd = open(name, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+	if(fd == -1){
+		fprintf(stderr, "mysh: %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if(append){
+		lseek(fd, 0, SEEK_END);
+	}
+	return fd;
+}
+
+
+/*
+ * Function: fanout_run
+ * --------------------
+ *  Runs 'producer |> target |> target ...': everything the producer writes is sent to
+ *  every target, a command (its stdin) or a file ('>file', '>>file'). The data never
+ *  passes through user memory: each round, tee(2) duplicates what is in the producer's
+ *  pipe into an empty intermediate pipe per target, splice(2) discards it from the
+ *  producer's pipe and then moves each copy on to its target. The intermediate pipes
+ *  have the same size as the producer's, so a tee always takes all of it. A target that
+ *  is closed early is dropped, the others keep receiving.
+ *
+ *  **param: Command, split at '|>'
+ *  no_params: Number of parameters in param
+ *
+ *  returns: 0 on success or error in the command, -1 on fork error.
+ */
+int fanout_run(char **param, int no_params){
+
+	int stage[FANOUT_MAX + 1];
+	int no_targets = 0;
+
+	/* Split into stages */
+	if(strcmp(param[no_params - 1], BG_SIGN) == 0){
+		fprintf(stderr, "mysh: %s: fan-out can not run in the background\n", FANOUT_SIGN);
+		return 0;
+	}
+	stage[0] = 0;
+	for(int i = 0; i < no_params; i++){
+		if(strcmp(param[i], FANOUT_SIGN) != 0){
+			continue;
+		}
+		param[i] = NULL;
+		if(no_targets == FANOUT_MAX){
+			fprintf(stderr, "mysh: %s: at most %d targets\n", FANOUT_SIGN, FANOUT_MAX);
+			return 0;
+		}
+		stage[++no_targets] = i + 1;
+	}
+	for(int k = 0; k <= no_targets; k++){
+		char *cmd = param[stage[k]];
+		if(cmd == NULL || (builtin_index(cmd) != -1) || (k == 0 && cmd[0] == '>')){
+			fprintf(stderr, "mysh: %s: usage: producer %s >file|command [%s ...]\n", FANOUT_SIGN, FANOUT_SIGN, FANOUT_SIGN);
+			return 0;
+		}
+	}
+
+	uint64_t start = stats_now();
+	int in[2];
+	int out[FANOUT_MAX];
+	int tmp[FANOUT_MAX][2];
+	int dead[FANOUT_MAX];
+	int ret = 0;
+	int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if(devnull == -1){
+		perror("mysh: |>");
+		return 0;
+	}
+
+	/* SIGPIPE only for this command */
+	struct sigaction sa, old_sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &sigpipe_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPIPE, &sa, &old_sa);
+
+	m->no_batch_running = 0;
+	m->batch_code = 0;
+	m->batch_failed = 0;
+
+	if(pipe2(in, O_CLOEXEC) == -1){
+		perror("mysh: |>");
+		close(devnull);
+		sigaction(SIGPIPE, &old_sa, NULL);
+		return 0;
+	}
+	fcntl(in[0], F_SETPIPE_SZ, FANOUT_PIPE_SZ);
+	int pipe_size = fcntl(in[0], F_GETPIPE_SZ);
+
+	/* Targets and their intermediate pipes */
+	for(int k = 0; k < no_targets; k++){
+		char **args = param + stage[k + 1];
+		out[k] = -1;
+		tmp[k][0] = tmp[k][1] = -1;
+		dead[k] = TRUE;
+
+		if(pipe2(tmp[k], O_CLOEXEC) == -1){
+			perror("mysh: |>");
+			continue;
+		}
+		if(fcntl(tmp[k][0], F_SETPIPE_SZ, pipe_size) < pipe_size){
+			perror("mysh: |>");
+			continue;
+		}
+
+		if(args[0][0] == '>'){
+			out[k] = fanout_open(args);
+		}
+		else{
+			int cmd_in[2];
+			if(pipe2(cmd_in, O_CLOEXEC) == -1){
+				perror("mysh: |>");
+				continue;
+			}
+			if(fanout_spawn(args, cmd_in[0], STDIN_FILENO) == -1){
+				close(cmd_in[1]);
+				ret = -1;
+			}
+			else{
+				out[k] = cmd_in[1];
+			}
+			close(cmd_in[0]);
+		}
+		dead[k] = (out[k] == -1);
+	}
+
+	/* Producer */
+	if(ret == 0 && fanout_spawn(param, in[1], STDOUT_FILENO) == -1){
+		ret = -1;
+	}
+	close(in[1]);
+
+	uint64_t total = 0;
+	while(ret == 0 && !m->signal_flag){
+		if(!ev_poll(in[0], admit_timeout())){
+			continue;
+		}
+
+		/* Duplicate into the first live target's pipe, the others get as much */
+		ssize_t n = 0;
+		int live = FALSE;
+		for(int k = 0; k < no_targets; k++){
+			if(dead[k]){
+				continue;
+			}
+			if(!live){
+				live = TRUE;
+				n = tee(in[0], tmp[k][1], INT_MAX, SPLICE_F_NONBLOCK);
+				if(n <= 0){
+					break;
+				}
+			}
+			else if(tee(in[0], tmp[k][1], n, SPLICE_F_NONBLOCK) != n){
+				fprintf(stderr, "mysh: %s: could not copy to target %d\n", FANOUT_SIGN, k + 1);
+				dead[k] = TRUE;
+			}
+		}
+
+		/* No live targets: the producer's output is discarded */
+		if(!live){
+			n = splice(in[0], NULL, devnull, NULL, INT_MAX, SPLICE_F_NONBLOCK);
+		}
+		else if(n > 0 && splice(in[0], NULL, devnull, NULL, n, 0) != n){
+			perror("mysh: |>");
+			break;
+		}
+		if(n == 0){
+			break;
+		}
+		if(n < 0){
+			if(errno == EAGAIN || errno == EINTR){
+				continue;
+			}
+			perror("mysh: |>");
+			break;
+		}
+		total += n;
+
+		/* Move each copy on to its target */
+		for(int k = 0; k < no_targets; k++){
+			size_t left = n;
+			while(!dead[k] && left > 0){
+				ssize_t s = splice(tmp[k][0], NULL, out[k], NULL, left, SPLICE_F_MOVE);
+				if(s < 0 && errno == EINTR){
+					continue;
+				}
+				if(s <= 0){
+					/* Closed early, e.g head */
+					if(errno != EPIPE){
+						fprintf(stderr, "mysh: %s: target %d: %s\n", FANOUT_SIGN, k + 1, strerror(errno));
+					}
+					dead[k] = TRUE;
+					break;
+				}
+				left -= s;
+			}
+			/* Empty the pipe of a dropped target */
+			while(dead[k] && left > 0 && tmp[k][0] != -1){
+				ssize_t s = splice(tmp[k][0], NULL, devnull, NULL, left, SPLICE_F_NONBLOCK);
+				if(s <= 0){
+					break;
+				}
+				left -= s;
+			}
+		}
+	}
+
+	/* End of input for the targets */
+	close(in[0]);
+	for(int k = 0; k < no_targets; k++){
+		if(out[k] != -1){
+			close(out[k]);
+		}
+		if(tmp[k][0] != -1){
+			close(tmp[k][0]);
+			close(tmp[k][1]);
+		}
+	}
+	close(devnull);
+
+	while(m->no_batch_running){
+		ev_poll(-1, admit_timeout());
+	}
+	sigaction(SIGPIPE, &old_sa, NULL);
+
+	m->fg_status = m->batch_failed ? 1 << 8 : 0;
+	if(start){
+		stats_record(param[0], STAT_RUN, stats_now() - start);
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: Fan-out: %lu bytes to %d targets, pipe size %d\n", (unsigned long)total, no_targets, pipe_size);
+#endif
+
+	return ret;
+}
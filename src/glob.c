@@ -0,0 +1,587 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* Buffer for reading directory entries in large batches */
+static char dents[GLOB_DENTS_BUF] __attribute__((aligned(8)));
+
+
+/*
+ * Function: has_meta
+ * --------------------
+ *  Checks if a string has unescaped glob characters: '*', '?' or a complete '[...]'.
+ *
+ *  *str: String to check
+ *  len: Number of bytes to check
+ *
+ *  returns: 1 if it has, 0 if not.
+ */
+static int has_meta(const char *str, size_t len){
+
+	for(size_t i = 0; i < len; i++){
+		if(str[i] == '\\'){
+			i++;
+		}
+		else if(str[i] == '*' || str[i] == '?'){
+			return TRUE;
+		}
+		else if(str[i] == '[' && memchr(str + i + 1, ']', len - i - 1) != NULL){
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+
+/*
+ * Function: glob_compile
+ * --------------------
+ *  Compiles a pattern for one path component into steps, allocated in the command arena.
+ *  The literal prefix is returned too, so a sorted listing can be searched for it.
+ *
+ *  *pat: Pattern, without '/'
+ *  **ops: Where to store the steps
+ *  **prefix: Where to store the literal prefix
+ *
+ *  returns: Number of steps, -1 if out of memory.
+ */
+int glob_compile(const char *pat, glob_op **ops, char **prefix){
+
+	size_t len = strlen(pat);
+	glob_op *op = arena_alloc(&m->arena, (len + 1) * sizeof(glob_op));
+	char *pre = arena_alloc(&m->arena, len + 1);
+	int n = 0;
+	int literal = TRUE;
+	size_t pre_len = 0;
+
+	if(op == NULL || pre == NULL){
+		return -1;
+	}
+
+	for(size_t i = 0; i < len; i++){
+		op[n].type = GLOB_CHAR;
+		op[n].c = pat[i];
+
+		if(pat[i] == '\\' && i + 1 < len){
+			op[n].c = pat[++i];
+		}
+		else if(pat[i] == '*'){
+			/* '**' is the same as '*' */
+			if(n > 0 && op[n - 1].type == GLOB_STAR){
+				continue;
+			}
+			op[n].type = GLOB_STAR;
+		}
+		else if(pat[i] == '?'){
+			op[n].type = GLOB_ANY;
+		}
+		else if(pat[i] == '['){
+			/* Find the end, a ']' first in the set is a member */
+			size_t j = i + 1;
+			int negate = (pat[j] == '!' || pat[j] == '^');
+			if(negate){
+				j++;
+			}
+			size_t start = j;
+			if(pat[j] == ']'){
+				j++;
+			}
+			while(j < len && pat[j] != ']'){
+				j++;
+			}
+
+			/* No end, '[' is literal */
+			if(j < len){
+				op[n].type = GLOB_SET;
+				memset(op[n].set, 0, sizeof(op[n].set));
+				for(size_t k = start; k < j; k++){
+					unsigned char lo = pat[k];
+					unsigned char hi = lo;
+					if(k + 2 < j && pat[k + 1] == '-'){
+						hi = pat[k + 2];
+						k += 2;
+					}
+					for(int c = lo; c <= hi; c++){
+						op[n].set[c / 32] |= 1u << (c % 32);
+					}
+				}
+				if(negate){
+					for(int k = 0; k < 8; k++){
+						op[n].set[k] = ~op[n].set[k];
+					}
+				}
+				i = j;
+			}
+		}
+
+		if(op[n].type != GLOB_CHAR){
+			literal = FALSE;
+		}
+		else if(literal){
+			pre[pre_len++] = op[n].c;
+		}
+		n++;
+	}
+
+	pre[pre_len] = '\0';
+	*ops = op;
+	*prefix = pre;
+	return n;
+}
+
+
+/*
+ * Function: glob_match
+ * --------------------
+ *  Matches a name against a compiled pattern. On a mismatch after a '*', the '*' takes
+ *  one more character and matching resumes there, so no recursion is needed.
+ *
+ *  *ops: Compiled pattern
+ *  no_ops: Number of steps
+ *  *str: Name
+ *
+ *  returns: 1 on match, 0 if not.
+ */
+int glob_match(const glob_op *ops, int no_ops, const char *str){
+
+	int i = 0;
+	int star = -1;
+	const char *star_str = NULL;
+
+	while(*str){
+		if(i < no_ops && ops[i].type == GLOB_STAR){
+			star = ++i;
+			star_str = str;
+			continue;
+		}
+		if(i < no_ops){
+			unsigned char c = *str;
+			const glob_op *op = &ops[i];
+			if(op->type == GLOB_ANY || (op->type == GLOB_CHAR && op->c == c) ||
+					(op->type == GLOB_SET && (op->set[c / 32] & (1u << (c % 32))))){
+				i++;
+				str++;
+				continue;
+			}
+		}
+		if(star == -1){
+			return FALSE;
+		}
+		i = star;
+		str = ++star_str;
+	}
+
+	while(i < no_ops && ops[i].type == GLOB_STAR){
+		i++;
+	}
+	return i == no_ops;
+}
+
+
+/*
+ * Function: names_cmp
+ * --------------------
+ *  qsort compare function for names.
+ */
+static int names_cmp(const void *a, const void *b){
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/*
+ * Function: dir_read
+ * --------------------
+ *  Reads a directory into a listing with getdents64 and sorts it. The buffers of the
+ *  listing are reused, and only grown when too small.
+ *
+ *  *d: Listing to fill
+ *  *path: Directory
+ *
+ *  returns: 0 on success, -1 on error.
+ */
+static int dir_read(dir_list *d, const char *path){
+
+	int fd = open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1){
+		return -1;
+	}
+
+	d->buf_used = 0;
+	d->no_names = 0;
+
+	long nread;
+	while((nread = getdents64(fd, dents, sizeof(dents))) > 0){
+		for(long pos = 0; pos < nread;){
+			struct dirent64 *e = (struct dirent64*)(dents + pos);
+			pos += e->d_reclen;
+
+			if(e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0'))){
+				continue;
+			}
+
+			size_t len = strlen(e->d_name) + 2;
+			if(d->buf_used + len > d->buf_size){
+				size_t size = d->buf_size ? d->buf_size * 2 : 4096;
+				while(d->buf_used + len > size){
+					size *= 2;
+				}
+				char *buf = mysh_realloc(d->buf, size);
+				if(buf == NULL){
+					close(fd);
+					return -1;
+				}
+				d->buf = buf;
+				d->buf_size = size;
+			}
+			if(d->no_names == d->names_cap){
+				int cap = d->names_cap ? d->names_cap * 2 : 256;
+				char **names = mysh_realloc(d->names, cap * sizeof(char*));
+				if(names == NULL){
+					close(fd);
+					return -1;
+				}
+				d->names = names;
+				d->names_cap = cap;
+			}
+
+			/* Offsets until buf stops moving */
+			d->buf[d->buf_used] = e->d_type;
+			memcpy(d->buf + d->buf_used + 1, e->d_name, len - 1);
+			d->names[d->no_names++] = (char*)(uintptr_t)(d->buf_used + 1);
+			d->buf_used += len;
+		}
+	}
+	close(fd);
+
+	if(nread == -1){
+		return -1;
+	}
+
+	for(int i = 0; i < d->no_names; i++){
+		d->names[i] = d->buf + (uintptr_t)d->names[i];
+	}
+	qsort(d->names, d->no_names, sizeof(char*), &names_cmp);
+	return 0;
+}
+
+
+/*
+ * Function: dir_load
+ * --------------------
+ *  Makes a listing hold the sorted entries of a directory, reading it only if the
+ *  listing is of another directory or the directory has changed. A listing is only
+ *  reused if the directory's mtime was more than a second older than the time it was
+ *  read, since changes within the same timestamp tick cannot be seen.
+ *
+ *  *d: Listing
+ *  *path: Directory, "" for the current directory
+ *
+ *  returns: 0 if the listing was reused, 1 if the directory was read, -1 on error.
+ */
+int dir_load(dir_list *d, const char *path){
+
+	struct stat st;
+	if(stat(path[0] ? path : ".", &st) == -1 || !S_ISDIR(st.st_mode) || strlen(path) >= PATH_BUFSIZE){
+		return -1;
+	}
+
+	if(d->valid && strcmp(d->path, path) == 0 && d->dev == st.st_dev && d->ino == st.st_ino &&
+			d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec){
+		m->dcache_hits++;
+		return 0;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	m->dcache_misses++;
+	strcpy(d->path, path);
+	d->valid = FALSE;
+	if(dir_read(d, path) == -1){
+		d->no_names = 0;
+		return -1;
+	}
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->mtime = st.st_mtim;
+	d->valid = (now.tv_sec - st.st_mtim.tv_sec > 1);
+	return 1;
+}
+
+
+/*
+ * Function: dir_get
+ * --------------------
+ *  Sorted listing of a directory from the cache, loaded into the least recently used
+ *  slot if not there.
+ *
+ *  *path: Directory, "" for the current directory
+ *
+ *  returns: Listing, valid until the next call. NULL on error.
+ */
+dir_list *dir_get(const char *path){
+
+	/* Find the directory, or the least recently used slot */
+	dir_list *d = &m->dcache[0];
+	for(int i = 0; i < GLOB_CACHE; i++){
+		dir_list *cur = &m->dcache[i];
+		if(cur->tick && strcmp(cur->path, path) == 0){
+			d = cur;
+			break;
+		}
+		if(cur->tick < d->tick){
+			d = cur;
+		}
+	}
+
+	d->tick = ++m->dcache_tick;
+	if(dir_load(d, path) == -1){
+		d->tick = 0;
+		return NULL;
+	}
+	return d;
+}
+
+
+/*
+ * Function: dir_find
+ * --------------------
+ *  Binary search for the first name in a listing starting with a prefix.
+ *
+ *  *d: Listing
+ *  *prefix: Prefix
+ *  len: Length of prefix
+ *
+ *  returns: Index of the first name with the prefix, or where it would be.
+ */
+int dir_find(dir_list *d, const char *prefix, size_t len){
+
+	int lo = 0;
+	int hi = d->no_names;
+	while(lo < hi){
+		int mid = (lo + hi) / 2;
+		if(strncmp(d->names[mid], prefix, len) < 0){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+
+/*
+ * Function: glob_add
+ * --------------------
+ *  Appends a copy of a string to an argument array in the command arena, growing it
+ *  when full. There is always room for the closing NULL.
+ *
+ *  returns: 0 on success, -1 if out of memory.
+ */
+static int glob_add(char ***out, int *pos, int *cap, const char *str, size_t len){
+
+	if(*pos + 1 >= *cap){
+		char **grown = arena_alloc(&m->arena, 2 * *cap * sizeof(char*));
+		if(grown == NULL){
+			return -1;
+		}
+		memcpy(grown, *out, *pos * sizeof(char*));
+		*out = grown;
+		*cap *= 2;
+	}
+
+	char *copy = arena_strndup(&m->arena, str, len);
+	if(copy == NULL){
+		return -1;
+	}
+	(*out)[(*pos)++] = copy;
+	return 0;
+}
+
+
+/*
+ * Function: glob_dir
+ * --------------------
+ *  Expands the rest of a pattern below a directory, one path component at a time.
+ *  Matches are found in the sorted listing by searching for the component's literal
+ *  prefix, so they come out sorted.
+ *
+ *  *path: Buffer of PATH_BUFSIZE with the directory matched so far, ending in '/' or empty
+ *  len: Length of path
+ *  *rest: Rest of the pattern
+ *  ***out, *pos, *cap: Argument array to append matches to
+ *
+ *  returns: 0 on success, -1 if out of memory.
+ */
+static int glob_dir(char *path, size_t len, const char *rest, char ***out, int *pos, int *cap){
+
+	/* Pattern ended with '/': matches directories only */
+	if(*rest == '\0'){
+		struct stat st;
+		if(stat(path, &st) == 0 && S_ISDIR(st.st_mode)){
+			return glob_add(out, pos, cap, path, len);
+		}
+		return 0;
+	}
+
+	const char *slash = strchr(rest, '/');
+	size_t comp_len = slash ? (size_t)(slash - rest) : strlen(rest);
+	const char *next = slash ? slash + 1 : NULL;
+
+	/* Literal component, only checked to exist when last */
+	if(!has_meta(rest, comp_len)){
+		for(size_t i = 0; i < comp_len; i++){
+			if(rest[i] == '\\' && i + 1 < comp_len){
+				i++;
+			}
+			if(len + 2 >= PATH_BUFSIZE){
+				return 0;
+			}
+			path[len++] = rest[i];
+		}
+		if(next == NULL){
+			struct stat st;
+			path[len] = '\0';
+			return lstat(path, &st) == 0 ? glob_add(out, pos, cap, path, len) : 0;
+		}
+		path[len++] = '/';
+		path[len] = '\0';
+		return glob_dir(path, len, next, out, pos, cap);
+	}
+
+	char *comp = arena_strndup(&m->arena, rest, comp_len);
+	glob_op *ops;
+	char *prefix;
+	if(comp == NULL){
+		return -1;
+	}
+	int no_ops = glob_compile(comp, &ops, &prefix);
+	if(no_ops == -1){
+		return -1;
+	}
+
+	dir_list *d = dir_get(path);
+	if(d == NULL){
+		return 0;
+	}
+
+	/* Dot files only match an explicit leading '.' */
+	int dots = (no_ops > 0 && ops[0].type == GLOB_CHAR && ops[0].c == '.');
+
+	/* First name with the literal prefix */
+	size_t pre_len = strlen(prefix);
+	int lo = dir_find(d, prefix, pre_len);
+
+	/* Last component: add matches straight from the listing */
+	if(next == NULL){
+		for(int i = lo; i < d->no_names && strncmp(d->names[i], prefix, pre_len) == 0; i++){
+			char *name = d->names[i];
+			size_t name_len = strlen(name);
+			if((name[0] == '.' && !dots) || !glob_match(ops, no_ops, name) || len + name_len >= PATH_BUFSIZE){
+				continue;
+			}
+			memcpy(path + len, name, name_len + 1);
+			if(glob_add(out, pos, cap, path, len + name_len) == -1){
+				return -1;
+			}
+		}
+		path[len] = '\0';
+		return 0;
+	}
+
+	/* Copy out matching directories, going deeper can replace the listing */
+	int no_match = 0;
+	char **match = arena_alloc(&m->arena, (d->no_names - lo + 1) * sizeof(char*));
+	if(match == NULL){
+		return -1;
+	}
+	for(int i = lo; i < d->no_names && strncmp(d->names[i], prefix, pre_len) == 0; i++){
+		char *name = d->names[i];
+		unsigned char type = name[-1];
+		if((name[0] == '.' && !dots) || (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN) ||
+				!glob_match(ops, no_ops, name)){
+			continue;
+		}
+		if((match[no_match++] = arena_strndup(&m->arena, name, strlen(name))) == NULL){
+			return -1;
+		}
+	}
+
+	for(int i = 0; i < no_match; i++){
+		size_t name_len = strlen(match[i]);
+		if(len + name_len + 2 >= PATH_BUFSIZE){
+			continue;
+		}
+		memcpy(path + len, match[i], name_len);
+		path[len + name_len] = '/';
+		path[len + name_len + 1] = '\0';
+		if(glob_dir(path, len + name_len + 1, next, out, pos, cap) == -1){
+			return -1;
+		}
+	}
+	path[len] = '\0';
+	return 0;
+}
+
+
+/*
+ * Function: glob_expand
+ * --------------------
+ *  Replaces arguments with '*', '?' or '[...]' by the sorted paths they match. Arguments
+ *  without matches are kept as they are, as in sh. Dot files are only matched by
+ *  patterns starting with '.'. The new array is allocated in the command arena. The
+ *  range of expanded arguments is kept in glob_first and glob_last.
+ *
+ *  ***param: Pointer to the argument array, replaced if anything is expanded
+ *  no_params: Number of arguments
+ *
+ *  returns: New number of arguments, -1 if out of memory.
+ */
+int glob_expand(char ***param, int no_params){
+
+	char **in = *param;
+	int i;
+
+	m->glob_first = -1;
+	m->glob_last = -1;
+
+	for(i = 0; i < no_params && !has_meta(in[i], strlen(in[i])); i++);
+	if(i == no_params){
+		return no_params;
+	}
+
+	int pos = 0;
+	int cap = no_params + PARAMS_BUFSIZE;
+	char **out = arena_alloc(&m->arena, cap * sizeof(char*));
+	char path[PATH_BUFSIZE];
+	if(out == NULL){
+		return -1;
+	}
+
+	for(i = 0; i < no_params; i++){
+		int before = pos;
+		path[0] = '\0';
+		if(has_meta(in[i], strlen(in[i])) && glob_dir(path, 0, in[i], &out, &pos, &cap) == -1){
+			return -1;
+		}
+		if(pos == before && glob_add(&out, &pos, &cap, in[i], strlen(in[i])) == -1){
+			return -1;
+		}
+		else if(pos != before + 1 || strcmp(out[before], in[i]) != 0){
+			m->glob_first = (m->glob_first == -1) ? before : m->glob_first;
+			m->glob_last = pos - 1;
+		}
+	}
+
+	out[pos] = NULL;
+	*param = out;
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: Glob expanded %d arguments to %d, directory cache %lu hits, %lu misses\n",
+			no_params, pos, m->dcache_hits, m->dcache_misses);
+#endif
+
+	return pos;
+}
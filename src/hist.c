@@ -0,0 +1,277 @@
+#include "mysh.h"
+
+/* Data handling struct for history */
+extern h_mem h_m;
+
+
+/*
+ * Function: hist_hash
+ * --------------------
+ *  FNV-1a hash of a history input, used to find duplicates without decoding.
+ *
+ *  *line: Input to hash
+ *  len: Length of the input
+ *
+ *  returns: 32 bit hash.
+ */
+uint32_t hist_hash(const char *line, size_t len){
+
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++){
+		hash ^= (unsigned char)line[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/*
+ * Function: hist_view
+ * --------------------
+ *  Borrowed view of a front coded history input, straight into the datablocks. The first
+ *  'shared' bytes are found in the older inputs of the chain, the rest in the input's own
+ *  blocks. Valid until history is changed.
+ *
+ *  n: History input, 0 is the newest
+ *  *iov: Array of at least HIST_MAX_DEPTH + 1 segments, in order
+ *
+ *  returns: Number of segments, -1 if there is no such input.
+ */
+int hist_view(int n, struct iovec *iov){
+
+	md *e = md_get(n);
+	if(e == NULL){
+		return -1;
+	}
+
+	/* Collect segments newest first, i.e from the end of the input */
+	struct iovec seg[HIST_MAX_DEPTH + 1];
+	int no_seg = 0;
+	int need = e->shared;
+
+	if(e->len > e->shared){
+		seg[no_seg].iov_base = &h_m.hist[e->block*BLOCK_SIZE];
+		seg[no_seg++].iov_len = e->len - e->shared;
+	}
+
+	/* Each older input holds the bytes from its own shared length and up */
+	for(md *cur = md_get(++n); need > 0 && cur != NULL && no_seg <= HIST_MAX_DEPTH; cur = md_get(++n)){
+		if(cur->shared < need){
+			seg[no_seg].iov_base = &h_m.hist[cur->block*BLOCK_SIZE];
+			seg[no_seg++].iov_len = need - cur->shared;
+			need = cur->shared;
+		}
+	}
+
+	for(int i = 0; i < no_seg; i++){
+		iov[i] = seg[no_seg - 1 - i];
+	}
+	return no_seg;
+}
+
+
+/*
+ * Function: hist_decode
+ * --------------------
+ *  Copies a history input out of the datablocks.
+ *
+ *  n: History input, 0 is the newest
+ *  *buf: Buffer of at least INPUT_BUFSIZE bytes
+ *
+ *  returns: Length of the input, -1 if there is no such input.
+ */
+int hist_decode(int n, char *buf){
+
+	struct iovec iov[HIST_MAX_DEPTH + 1];
+	int no_seg = hist_view(n, iov);
+	size_t len = 0;
+
+	if(no_seg == -1){
+		return -1;
+	}
+
+	for(int i = 0; i < no_seg; i++){
+		memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	buf[len] = '\0';
+	return len;
+}
+
+
+/*
+ * Function: hist_equal
+ * --------------------
+ *  Compares a history input to a line, hash and length first.
+ *
+ *  n: History input, 0 is the newest
+ *
+ *  returns: 1 if equal, 0 if not.
+ */
+int hist_equal(int n, const char *line, size_t len, uint32_t hash){
+
+	md *e = md_get(n);
+	if(e == NULL || e->hash != hash || e->len != len){
+		return 0;
+	}
+
+	struct iovec iov[HIST_MAX_DEPTH + 1];
+	int no_seg = hist_view(n, iov);
+	for(int i = 0; i < no_seg; i++){
+		if(memcmp(line, iov[i].iov_base, iov[i].iov_len) != 0){
+			return 0;
+		}
+		line += iov[i].iov_len;
+	}
+	return 1;
+}
+
+
+/*
+ * Function: hist_compact
+ * --------------------
+ *  Moves all allocated blocks to the start of the history memory, leaving all free
+ *  blocks as one run at the end.
+ */
+void hist_compact(){
+
+	char hist[MAX_BLOCKS*BLOCK_SIZE];
+	int next = 0;
+
+	memset(hist, '\0', sizeof(hist));
+	memset(h_m.bm, '\0', sizeof(h_m.bm));
+
+	for(int n = 0; n < h_m.no_md; n++){
+		md *cur = md_get(n);
+		if(!cur->no_blocks){
+			continue;
+		}
+		memcpy(&hist[next*BLOCK_SIZE], &h_m.hist[cur->block*BLOCK_SIZE], cur->no_blocks*BLOCK_SIZE);
+		cur->block = next;
+		for(int i = 0; i < cur->no_blocks; i++){
+			set_bit(h_m.bm, next++);
+		}
+	}
+
+	memcpy(h_m.hist, hist, sizeof(hist));
+}
+
+
+/*
+ * Function: hist_store
+ * --------------------
+ *  Allocates a run of blocks for the unshared part of an input and copies it there.
+ *
+ *  *e: History input, with len and shared set
+ *  *line: Full input
+ *
+ *  returns: 0 on success, -1 when not enough available blocks.
+ */
+int hist_store(md *e, const char *line){
+
+	int n = (e->len - e->shared + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	e->block = 0;
+	e->no_blocks = 0;
+	if(!n){
+		return 0;
+	}
+
+	/* Compact if there are enough free blocks, but no run long enough */
+	int b = get_free_run(h_m.bm, n);
+	if(b == -1 && test_n_free_bit(h_m.bm, n)){
+		hist_compact();
+		b = get_free_run(h_m.bm, n);
+	}
+	if(b == -1){
+		return -1;
+	}
+
+	for(int i = 0; i < n; i++){
+		set_bit(h_m.bm, b + i);
+	}
+	memcpy(&h_m.hist[b*BLOCK_SIZE], line + e->shared, e->len - e->shared);
+
+	e->block = b;
+	e->no_blocks = n;
+	return 0;
+}
+
+
+/*
+ * Function: hist_release
+ * --------------------
+ *  Clears the bits and memory of the blocks of a history input.
+ *
+ *  *e: History input
+ */
+void hist_release(md *e){
+
+	for(int i = 0; i < e->no_blocks; i++){
+		free_bit(h_m.bm, e->block + i);
+	}
+	memset(&h_m.hist[e->block*BLOCK_SIZE], '\0', e->no_blocks*BLOCK_SIZE);
+	e->no_blocks = 0;
+}
+
+
+/*
+ * Function: hist_remove
+ * --------------------
+ *  Removes a history input. If the next newer input shares more of its prefix than this
+ *  input's own shared part, the bytes it borrowed are moved into its blocks.
+ *
+ *  n: History input, 0 is the newest
+ */
+void hist_remove(int n){
+
+	md *e = md_get(n);
+	md *newer = md_get(n - 1);
+	char line[INPUT_BUFSIZE];
+
+	if(e == NULL){
+		return;
+	}
+
+	int reencode = (newer != NULL && newer->shared > e->shared);
+	if(reencode){
+		hist_decode(n - 1, line);
+	}
+
+	md removed = *e;
+	hist_release(e);
+	md_remove(n);
+
+	/* Never fails: the released blocks are enough for the longer suffix */
+	if(reencode){
+		newer = md_get(n - 1);
+		hist_release(newer);
+		newer->shared = removed.shared;
+		newer->depth = removed.depth;
+		hist_store(newer, line);
+	}
+
+#ifdef DEBUG
+	debug_bitmap(h_m.bm);
+	debug_datablocks(h_m.hist);
+#endif
+}
+
+
+/*
+ * Function: hist_evict
+ * --------------------
+ *  Removes the oldest history input.
+ *
+ *  returns: 0 on success, -1 if history is empty.
+ */
+int hist_evict(){
+
+	if(!h_m.no_md){
+		return -1;
+	}
+
+	hist_remove(h_m.no_md - 1);
+	return 0;
+}
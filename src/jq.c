@@ -0,0 +1,259 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+
+/*
+ * Function: qjob_before
+ * --------------------
+ *  Heap order of queued jobs: lower priority value first, then in order of arrival.
+ *
+ *  returns: 1 if 'a' should be admitted before 'b', 0 if not.
+ */
+static int qjob_before(qjob *a, qjob *b){
+	if(a->prio != b->prio){
+		return a->prio < b->prio;
+	}
+	return a->seq < b->seq;
+}
+
+
+/*
+ * Function: qjob_cmp
+ * --------------------
+ *  qsort comparator putting queued jobs in admission order.
+ */
+int qjob_cmp(const void *a, const void *b){
+	return qjob_before(*(qjob**)a, *(qjob**)b) ? -1 : 1;
+}
+
+
+/*
+ * Function: copy_argv
+ * --------------------
+ *  Copies a command and its arguments into one allocation, the pointers followed by
+ *  the strings, so it is freed with a single free.
+ *
+ *  **param: Command and arguments
+ *
+ *  returns: The copy, NULL if out of memory.
+ */
+static char **copy_argv(char **param){
+
+	int n = 0;
+	size_t size = sizeof(char*);
+	for(; param[n]; n++){
+		size += sizeof(char*) + strlen(param[n]) + 1;
+	}
+
+	char **argv = mysh_malloc(size);
+	if(argv == NULL){
+		return NULL;
+	}
+	char *str = (char*)(argv + n + 1);
+	for(int i = 0; i < n; i++){
+		size_t len = strlen(param[i]) + 1;
+		argv[i] = memcpy(str, param[i], len);
+		str += len;
+	}
+	argv[n] = NULL;
+	return argv;
+}
+
+
+/*
+ * Function: queue_job
+ * --------------------
+ *  Adds a background job to the admission queue. The arguments are copied as they are,
+ *  cmd is only the command line shown by jobs and may be cut short.
+ *
+ *  **param: Command and arguments, without '&'.
+ *  *policy: Placement policy to start the job with.
+ *
+ *  returns: 0 on success, -1 if the queue is full or out of memory.
+ */
+int queue_job(char **param, placement *policy){
+
+	if(m->no_queued >= MAX_QUEUED){
+		return -1;
+	}
+
+	qjob *new_job = pool_alloc(&m->qjob_pool);
+	if(new_job == NULL){
+		return -1;
+	}
+
+	new_job->argv = copy_argv(param);
+	if(new_job->argv == NULL){
+		pool_free(&m->qjob_pool, new_job);
+		return -1;
+	}
+	new_job->seq = m->queue_seq++;
+	new_job->prio = (policy->nice == PLACE_NICE_NONE) ? 0 : policy->nice;
+	new_job->place = *policy;
+	size_t len = 0;
+	new_job->cmd[0] = '\0';
+	for(int i = 0; param[i] && len < INPUT_BUFSIZE; i++){
+		len += snprintf(new_job->cmd + len, INPUT_BUFSIZE - len, "%s ", param[i]);
+	}
+
+	/* Sift up */
+	qjob **q = m->queue;
+	size_t i = m->no_queued++;
+	while(i > 0 && qjob_before(new_job, q[(i - 1) / 2])){
+		q[i] = q[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	q[i] = new_job;
+
+	return 0;
+}
+
+
+/*
+ * Function: dequeue_job
+ * --------------------
+ *  Removes the first job from the admission queue. The caller frees its argv and returns
+ *  it to qjob_pool.
+ *
+ *  returns: The job, NULL if the queue is empty.
+ */
+qjob *dequeue_job(){
+
+	if(!m->no_queued){
+		return NULL;
+	}
+
+	qjob **q = m->queue;
+	qjob *out = q[0];
+	qjob *last = q[--m->no_queued];
+
+	/* Sift down */
+	size_t i = 0;
+	while(TRUE){
+		size_t c = 2*i + 1;
+		if(c >= m->no_queued){
+			break;
+		}
+		if(c + 1 < m->no_queued && qjob_before(q[c + 1], q[c])){
+			c++;
+		}
+		if(!qjob_before(q[c], last)){
+			break;
+		}
+		q[i] = q[c];
+		i = c;
+	}
+	if(m->no_queued){
+		q[i] = last;
+	}
+
+	return out;
+}
+
+
+/*
+ * Function: read_pressure
+ * --------------------
+ *  Reads the 10 second 'some' average of a pressure stall information file.
+ *
+ *  *path: PSI file, e.g /proc/pressure/cpu
+ *
+ *  returns: Percentage of time stalled, -1 if PSI is unavailable.
+ */
+double read_pressure(const char *path){
+
+	char line[INPUT_BUFSIZE];
+	double avg10 = -1;
+
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return -1;
+	}
+	if(fgets(line, sizeof(line), f) == NULL || sscanf(line, "some avg10=%lf", &avg10) != 1){
+		avg10 = -1;
+	}
+	fclose(f);
+
+	return avg10;
+}
+
+
+/*
+ * Function: can_admit
+ * --------------------
+ *  Checks the admission thresholds: running background jobs and cpu/memory pressure.
+ *
+ *  *pressure: Set to 1 if the job was held back by pressure rather than job count.
+ *
+ *  returns: 1 if a job may be started now, 0 if not.
+ */
+int can_admit(int *pressure){
+
+	*pressure = FALSE;
+
+	if(m->max_running > 0 && m->no_jobs >= m->max_running){
+		return 0;
+	}
+
+	*pressure = TRUE;
+	if(m->max_cpu_psi >= 0){
+		double cpu = read_pressure("/proc/pressure/cpu");
+		if(cpu > m->max_cpu_psi){
+			return 0;
+		}
+	}
+	if(m->max_mem_psi >= 0){
+		double mem = read_pressure("/proc/pressure/memory");
+		if(mem > m->max_mem_psi){
+			return 0;
+		}
+	}
+
+	*pressure = FALSE;
+	return 1;
+}
+
+
+/*
+ * Function: admit_jobs
+ * --------------------
+ *  Starts queued jobs for as long as the admission thresholds allow. Called when a child
+ *  exits and when a job is queued. Not while a builtin's output is captured, the job
+ *  would print to the capture; admission is retried when the capture ends.
+ */
+void admit_jobs(){
+
+	int pressure;
+	if(m->term_fd != -1){
+		return;
+	}
+	m->queue_stalled = FALSE;
+
+	while(m->no_queued){
+		if(!can_admit(&pressure)){
+			m->queue_stalled = pressure;
+			return;
+		}
+
+		qjob *next = dequeue_job();
+
+		launch_job(next->argv, &next->place);
+		free(next->argv);
+		pool_free(&m->qjob_pool, next);
+	}
+}
+
+
+/*
+ * Function: admit_timeout
+ * --------------------
+ *  Child exits drive admission, but pressure can also drop while no job exits. Only
+ *  then is the queue rechecked after a timeout, matching the PSI avg10 update period.
+ *
+ *  returns: Poll timeout in milliseconds, -1 for none.
+ */
+int admit_timeout(){
+	return (m->no_queued && m->queue_stalled) ? PSI_RECHECK_MS : -1;
+}
@@ -0,0 +1,83 @@
+#include "mysh.h"
+
+/* Data handling struct for history */
+extern h_mem h_m;
+
+
+/*
+ * Function: md_slot
+ * ----------------------------
+ *   Returns the ring position of the 'pos' element, counted from the oldest.
+ *
+ *   pos: position from the oldest element
+ */
+static int md_slot(int pos){
+	return (h_m.first + pos) % MAX_HISTORY;
+}
+
+
+/*
+ * Function: md_get
+ * ----------------------------
+ *   Returns a pointer to the 'n' newest element of the deque in constant time.
+ *
+ *   n: n'th newest element, 0 is the newest
+ *
+ *   returns: A pointer to the element, NULL if there are not that many elements.
+ */
+md *md_get(int n){
+
+	if(n < 0 || n >= h_m.no_md){
+		return NULL;
+	}
+	return &h_m.md[md_slot(h_m.no_md - 1 - n)];
+}
+
+
+/*
+ * Function: md_push
+ * ----------------------------
+ *   Adds an element as the newest of the deque.
+ *
+ *   returns: A pointer to the new (uninitialized) element, NULL if the deque is full.
+ */
+md *md_push(){
+
+	if(h_m.no_md >= MAX_HISTORY){
+		return NULL;
+	}
+	return &h_m.md[md_slot(h_m.no_md++)];
+}
+
+
+/*
+ * Function: md_remove
+ * ----------------------------
+ *   Removes the 'n' newest element, moving the elements on the shorter side one step.
+ *
+ *   n: n'th newest element to remove, 0 is the newest
+ */
+void md_remove(int n){
+
+	int pos = h_m.no_md - 1 - n;
+
+	if(n < 0 || pos < 0){
+		return;
+	}
+
+	if(pos < h_m.no_md / 2){
+		/* Shift older elements towards the newer end */
+		for(int i = pos; i > 0; i--){
+			h_m.md[md_slot(i)] = h_m.md[md_slot(i - 1)];
+		}
+		h_m.first = md_slot(1);
+	}
+	else{
+		/* Shift newer elements towards the older end */
+		for(int i = pos; i < h_m.no_md - 1; i++){
+			h_m.md[md_slot(i)] = h_m.md[md_slot(i + 1)];
+		}
+	}
+
+	h_m.no_md--;
+}
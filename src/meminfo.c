@@ -0,0 +1,176 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* History memory */
+extern h_mem h_m;
+
+/* Allocation counters */
+extern alloc_stats a_stats;
+
+
+/*
+ * Function: cache_size
+ * --------------------
+ *  Adds up the valid listings of a directory cache.
+ *
+ *  *d: Listings
+ *  n: Number of listings
+ *  *dirs: Where to add the number of valid listings
+ *  *names: Where to add the number of names
+ *  *bytes: Where to add the bytes allocated for names and entries
+ */
+static void cache_size(dir_list *d, int n, int *dirs, size_t *names, size_t *bytes){
+
+	for(int i = 0; i < n; i++){
+		if(d[i].buf != NULL){
+			(*dirs)++;
+			*names += d[i].no_names;
+		}
+		*bytes += d[i].buf_size + d[i].names_cap * sizeof(char*);
+	}
+}
+
+
+/*
+ * Function: meminfo_collect
+ * --------------------
+ *  Collects the memory use of the shell's data structures.
+ *
+ *  *mi: Where to store it
+ */
+void meminfo_collect(meminfo *mi){
+
+	memset(mi, 0, sizeof(*mi));
+
+	/* History: used blocks and runs of free blocks */
+	int run = 0;
+	for(int i = 0; i <= MAX_BLOCKS; i++){
+		if(i < MAX_BLOCKS && !(h_m.bm[i / 8] & (1 << (i % 8)))){
+			run++;
+			continue;
+		}
+		if(i < MAX_BLOCKS){
+			mi->hist_blocks_used++;
+		}
+		if(run){
+			mi->hist_free_runs++;
+			if(run > mi->hist_largest_run){
+				mi->hist_largest_run = run;
+			}
+		}
+		run = 0;
+	}
+	mi->hist_cmds = h_m.no_md;
+	for(int i = 0; i < h_m.no_md; i++){
+		mi->hist_bytes += h_m.md[(h_m.first + i) % MAX_HISTORY].len;
+	}
+
+	/* Jobs and output buffered for them */
+	mi->jobs = m->no_jobs;
+	mi->queued = m->no_queued;
+	mi->job_slabs = m->job_pool.no_slabs;
+	mi->qjob_slabs = m->qjob_pool.no_slabs;
+	for(size_t i = 0; i < m->no_jobs; i++){
+		mi->job_output += m->jobs[i]->out_size;
+	}
+
+	/* Caches */
+	cache_size(m->dcache, GLOB_CACHE, &mi->dcache_dirs, &mi->dcache_names, &mi->dcache_bytes);
+	cache_size(m->pindex, COMP_PATH_DIRS, &mi->pindex_dirs, &mi->pindex_names, &mi->pindex_bytes);
+	mi->no_stats = m->no_stats;
+	mi->stats_bytes = m->stats_pool.no_slabs * POOL_SLAB * m->stats_pool.size;
+	mi->no_vars = m->no_vars;
+	mi->vars_cap = m->vars_cap;
+	mi->vars_bytes = m->vars_cap * sizeof(var);
+	for(size_t i = 0; i < m->vars_cap; i++){
+		if(m->vars[i].name != NULL){
+			mi->vars_bytes += strlen(m->vars[i].name) + 1 + m->vars[i].size;
+		}
+	}
+
+	/* Resident set, current from statm and peak from rusage */
+	FILE *f = fopen("/proc/self/statm", "r");
+	unsigned long size, resident;
+	if(f != NULL){
+		if(fscanf(f, "%lu %lu", &size, &resident) == 2){
+			mi->rss = resident * sysconf(_SC_PAGESIZE);
+		}
+		fclose(f);
+	}
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) == 0){
+		mi->rss_peak = (size_t)ru.ru_maxrss * 1024;
+	}
+}
+
+
+/*
+ * Function: meminfo_print
+ * --------------------
+ *  Prints memory use. Fragmentation is the share of free history blocks outside the
+ *  largest free run: a command needing more blocks than the run fails although enough
+ *  blocks are free, and history is compacted.
+ *
+ *  *mi: Memory use
+ */
+void meminfo_print(meminfo *mi){
+
+	int free_blocks = MAX_BLOCKS - mi->hist_blocks_used;
+	int frag = free_blocks ? 100 * (free_blocks - mi->hist_largest_run) / free_blocks : 0;
+
+	printf("History\n");
+	printf("  commands 		= %d of %d (%zu bytes)\n", mi->hist_cmds, MAX_HISTORY, mi->hist_bytes);
+	printf("  blocks 		= %d of %d used (%d bytes each)\n", mi->hist_blocks_used, MAX_BLOCKS, BLOCK_SIZE);
+	printf("  free runs 		= %d, largest %d blocks\n", mi->hist_free_runs, mi->hist_largest_run);
+	printf("  fragmentation 	= %d%%\n", frag);
+	printf("Jobs\n");
+	printf("  running 		= %zu of %d\n", mi->jobs, MAX_JOBS);
+	printf("  queued 		= %zu of %d\n", mi->queued, MAX_QUEUED);
+	printf("  pool slabs 		= %zu jobs, %zu queued\n", mi->job_slabs, mi->qjob_slabs);
+	printf("  output buffers 	= %zu bytes\n", mi->job_output);
+	printf("Caches\n");
+	printf("  glob directories 	= %d of %d, %zu names, %zu bytes\n", mi->dcache_dirs, GLOB_CACHE, mi->dcache_names, mi->dcache_bytes);
+	printf("  PATH index 		= %d directories, %zu names, %zu bytes\n", mi->pindex_dirs, mi->pindex_names, mi->pindex_bytes);
+	printf("  stats 		= %d of %d commands, %zu bytes\n", mi->no_stats, STATS_MAX, mi->stats_bytes);
+	printf("  variables 		= %zu in %zu slots, %zu bytes\n", mi->no_vars, mi->vars_cap, mi->vars_bytes);
+	printf("Allocators\n");
+	printf("  mallocs 		= %lu\n", a_stats.mallocs);
+	printf("  arena 		= %zu bytes in chunks, %zu used, %zu most used\n", a_stats.arena_size, a_stats.arena_used, a_stats.arena_high);
+	printf("  arena allocations 	= %lu in %lu commands\n", a_stats.arena_allocs, a_stats.arena_resets);
+	printf("  pool allocations 	= %lu, %lu frees\n", a_stats.pool_allocs, a_stats.pool_frees);
+	printf("Process\n");
+	printf("  RSS 			= %zu KiB (peak %zu KiB)\n", mi->rss / 1024, mi->rss_peak / 1024);
+}
+
+
+/*
+ * Function: meminfo_json
+ * --------------------
+ *  Prints memory use as a JSON object on one line, sizes in bytes.
+ *
+ *  *mi: Memory use
+ */
+void meminfo_json(meminfo *mi){
+
+	printf("{\"history\":{\"commands\":%d,\"max_commands\":%d,\"bytes\":%zu,\"blocks_used\":%d,"
+			"\"blocks\":%d,\"block_size\":%d,\"free_runs\":%d,\"largest_free_run\":%d},",
+			mi->hist_cmds, MAX_HISTORY, mi->hist_bytes, mi->hist_blocks_used,
+			MAX_BLOCKS, BLOCK_SIZE, mi->hist_free_runs, mi->hist_largest_run);
+	printf("\"jobs\":{\"running\":%zu,\"max_running\":%d,\"queued\":%zu,\"max_queued\":%d,"
+			"\"job_slabs\":%zu,\"queue_slabs\":%zu,\"output_bytes\":%zu},",
+			mi->jobs, MAX_JOBS, mi->queued, MAX_QUEUED, mi->job_slabs, mi->qjob_slabs, mi->job_output);
+	printf("\"caches\":{\"glob\":{\"dirs\":%d,\"max_dirs\":%d,\"names\":%zu,\"bytes\":%zu},"
+			"\"path_index\":{\"dirs\":%d,\"names\":%zu,\"bytes\":%zu},"
+			"\"stats\":{\"commands\":%d,\"max_commands\":%d,\"bytes\":%zu},"
+			"\"vars\":{\"vars\":%zu,\"slots\":%zu,\"bytes\":%zu}},",
+			mi->dcache_dirs, GLOB_CACHE, mi->dcache_names, mi->dcache_bytes,
+			mi->pindex_dirs, mi->pindex_names, mi->pindex_bytes,
+			mi->no_stats, STATS_MAX, mi->stats_bytes, mi->no_vars, mi->vars_cap, mi->vars_bytes);
+	printf("\"allocators\":{\"mallocs\":%lu,\"arena_size\":%zu,\"arena_used\":%zu,\"arena_high\":%zu,"
+			"\"arena_allocs\":%lu,\"arena_resets\":%lu,\"pool_allocs\":%lu,\"pool_frees\":%lu},",
+			a_stats.mallocs, a_stats.arena_size, a_stats.arena_used, a_stats.arena_high,
+			a_stats.arena_allocs, a_stats.arena_resets, a_stats.pool_allocs, a_stats.pool_frees);
+	printf("\"rss\":%zu,\"rss_peak\":%zu}\n", mi->rss, mi->rss_peak);
+}
@@ -0,0 +1,299 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* Buffer for reading job output in large batches */
+static char mbuf[MUX_READ];
+
+
+/*
+ * Function: write_iov
+ * --------------------
+ *  writev that continues after partial writes, to the shell's stdout. While a builtin's
+ *  output is captured that is term_fd, so job output does not end up in the capture.
+ *
+ *  *iov: Segments, changed on partial writes
+ *  n: Number of segments
+ */
+static void write_iov(struct iovec *iov, int n){
+
+	int fd = (m->term_fd != -1) ? m->term_fd : STDOUT_FILENO;
+	while(n > 0){
+		ssize_t w = writev(fd, iov, n);
+		if(w < 0 && errno == EINTR){
+			continue;
+		}
+		if(w < 0){
+			return;
+		}
+		while(n > 0 && (size_t)w >= iov->iov_len){
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0){
+			iov->iov_base = (char*)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+}
+
+
+/*
+ * Function: mux_keep
+ * --------------------
+ *  Appends output to a job's buffer, growing it when needed.
+ *
+ *  *j: Job
+ *  *data: Output
+ *  len: Length of output
+ *
+ *  returns: 0 on success, -1 if out of memory (the output is dropped).
+ */
+static int mux_keep(job *j, const char *data, size_t len){
+
+	if(j->out_len + len > j->out_size){
+		size_t size = j->out_size ? j->out_size : MUX_READ;
+		while(j->out_len + len > size){
+			size *= 2;
+		}
+		char *out = mysh_realloc(j->out, size);
+		if(out == NULL){
+			return -1;
+		}
+		j->out = out;
+		j->out_size = size;
+	}
+	memcpy(j->out + j->out_len, data, len);
+	j->out_len += len;
+	return 0;
+}
+
+
+/*
+ * Function: mux_lines
+ * --------------------
+ *  Writes the complete lines of a job's output, each with the job's tag, in batches of
+ *  up to MUX_IOV lines per writev. A line started in earlier output is completed from
+ *  the job's buffer, and the unfinished end of the output is kept there.
+ *
+ *  *j: Job
+ *  *data: Output
+ *  len: Length of output
+ */
+static void mux_lines(job *j, const char *data, size_t len){
+
+	struct iovec iov[3 * MUX_IOV];
+	int n = 0;
+	int tag_len = strlen(j->tag);
+	const char *end = data + len;
+
+	while(data < end){
+		const char *nl = memchr(data, '\n', end - data);
+		if(nl == NULL){
+			break;
+		}
+
+		iov[n].iov_base = j->tag;
+		iov[n++].iov_len = tag_len;
+		if(j->out_len){
+			iov[n].iov_base = j->out;
+			iov[n++].iov_len = j->out_len;
+		}
+		iov[n].iov_base = (char*)data;
+		iov[n++].iov_len = nl + 1 - data;
+		data = nl + 1;
+
+		/* The start of the line is written, the buffer can be reused after */
+		if(j->out_len){
+			write_iov(iov, n);
+			j->out_len = 0;
+			n = 0;
+		}
+		if(n >= 3 * MUX_IOV - 3){
+			write_iov(iov, n);
+			n = 0;
+		}
+	}
+	write_iov(iov, n);
+
+	if(data < end){
+		mux_keep(j, data, end - data);
+	}
+
+	/* Too long a line is written in parts */
+	if(j->out_len >= MUX_READ){
+		struct iovec part[3] = { { j->tag, tag_len }, { j->out, j->out_len }, { "\n", 1 } };
+		write_iov(part, 3);
+		j->out_len = 0;
+	}
+}
+
+
+/*
+ * Function: mux_pipe
+ * --------------------
+ *  Creates the pipe a background job writes its output to, when output is multiplexed.
+ *
+ *  fds[2]: Where to store the pipe, both -1 when output goes straight to the terminal
+ *
+ *  returns: 0 on success, -1 on error.
+ */
+int mux_pipe(int fds[2]){
+
+	fds[0] = -1;
+	fds[1] = -1;
+	if(m->mux_mode == MUX_OFF){
+		return 0;
+	}
+	if(pipe2(fds, O_CLOEXEC) == -1){
+		perror("mysh: output");
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+
+/*
+ * Function: mux_attach
+ * --------------------
+ *  Makes the shell collect a job's output from the read end of its pipe.
+ *
+ *  *j: Job
+ *  fd: Read end of the pipe
+ *  num: Job number, for the tag
+ */
+void mux_attach(job *j, int fd, int num){
+
+	j->out_fd = fd;
+	j->out_mode = m->mux_mode;
+	snprintf(j->tag, sizeof(j->tag), "[%%%d %d] ", num, j->pid);
+}
+
+
+/*
+ * Function: mux_read
+ * --------------------
+ *  Reads what a job has written, until the pipe is empty. Complete lines are written
+ *  with the job's tag, or all output is kept until the job ends when grouped.
+ *
+ *  *j: Job
+ */
+void mux_read(job *j){
+
+	while(j->out_fd != -1){
+		ssize_t n = read(j->out_fd, mbuf, sizeof(mbuf));
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0 && errno == EAGAIN){
+			return;
+		}
+
+		/* End of output, or error */
+		if(n <= 0){
+			close(j->out_fd);
+			j->out_fd = -1;
+			return;
+		}
+
+		if(j->out_mode == MUX_TAG){
+			mux_lines(j, mbuf, n);
+		}
+		else{
+			mux_keep(j, mbuf, n);
+		}
+	}
+}
+
+
+/*
+ * Function: mux_flush
+ * --------------------
+ *  Writes the rest of a job's output when the job ends: an unfinished last line, or all
+ *  output under a header when grouped. Output written after this, by children the job
+ *  left behind, is not collected.
+ *
+ *  *j: Job
+ */
+void mux_flush(job *j){
+
+	mux_read(j);
+	if(j->out_fd != -1){
+		close(j->out_fd);
+		j->out_fd = -1;
+	}
+
+	if(j->out_len){
+		int tag_len = strlen(j->tag);
+		int nl = (j->out[j->out_len - 1] != '\n');
+		struct iovec iov[4] = { { j->tag, tag_len }, { j->out, j->out_len }, { "\n", nl } };
+		if(j->out_mode == MUX_GROUP){
+			iov[0].iov_len = tag_len - 1;
+			iov[1].iov_base = "\n";
+			iov[1].iov_len = 1;
+			iov[2].iov_base = j->out;
+			iov[2].iov_len = j->out_len;
+			iov[3].iov_base = "\n";
+			iov[3].iov_len = nl;
+		}
+		fflush(stdout);
+		write_iov(iov, j->out_mode == MUX_GROUP ? 4 : 3);
+	}
+
+	free(j->out);
+	j->out = NULL;
+	j->out_len = 0;
+	j->out_size = 0;
+}
+
+
+/*
+ * Function: mux_pollfds
+ * --------------------
+ *  Adds the output pipes of running jobs to a poll set.
+ *
+ *  *fds: Poll set with room for MAX_JOBS more
+ *
+ *  returns: Number of pipes added.
+ */
+int mux_pollfds(struct pollfd *fds){
+
+	int n = 0;
+	for(int i = 0; i < m->no_jobs; i++){
+		if(m->jobs[i]->out_fd != -1){
+			fds[n].fd = m->jobs[i]->out_fd;
+			fds[n].events = POLLIN;
+			fds[n++].revents = 0;
+		}
+	}
+	return n;
+}
+
+
+/*
+ * Function: mux_events
+ * --------------------
+ *  Reads the output of jobs whose pipes are ready.
+ *
+ *  *fds: Poll set from mux_pollfds, after poll
+ *  n: Number of pipes in fds
+ */
+void mux_events(struct pollfd *fds, int n){
+
+	/* Lines go out in one piece, after what the shell has printed */
+	fflush(stdout);
+
+	for(int i = 0, k = 0; i < n && k < m->no_jobs; k++){
+		job *j = m->jobs[k];
+		if(j->out_fd != fds[i].fd){
+			continue;
+		}
+		if(fds[i].revents){
+			mux_read(j);
+		}
+		i++;
+	}
+}
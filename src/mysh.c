@@ -5,6 +5,8 @@
 struct h_mem h_m;
 /* Mysh info struct */
 struct mysh *m;
+/* Allocation counters */
+extern alloc_stats a_stats;
 
 
 /* Commands */
@@ -13,7 +15,14 @@ char *builtins_cmds[] = {
     "type",
     "h",
     "jobs",
-    "kill"
+    "kill",
+    "place",
+    "queue",
+    "stats",
+    "batch",
+    "output",
+    "meminfo",
+    "timeout"
 };
 
 
@@ -23,7 +32,14 @@ static int (*builtins[]) (char **) = {
 	&mysh_type,
 	&mysh_h,
 	&mysh_jobs,
-	&mysh_kill
+	&mysh_kill,
+	&mysh_place,
+	&mysh_queue,
+	&mysh_stats,
+	&mysh_batch,
+	&mysh_output,
+	&mysh_meminfo,
+	&mysh_timeout
 };
 
 
@@ -38,28 +54,37 @@ void sighandler(int sig){
  * Function:  main 
  * --------------------
  *  Initializes needed memory and datatypes, runs the main loop and cleans up memory before exit.
+ *  With a file argument, the file is run as a script (using script_run) instead.
  */
-int main() {
+int main(int argc, char **argv) {
+
+	int status = EXIT_SUCCESS;
 
 	/* [> Start shell.. <] */
 	init();
-	loop();
+
+	/* Run a script, or read commands */
+	if(argc > 1){
+		status = script_run(argv[1]);
+	}
+	else{
+		loop();
+	}
 
 	/* [> CLEANUP <] */
-	/* Remove, free and kill all jobs */
+	/* Kill all jobs, jobs and arena memory is released with the process */
 	for(int i = 0; i < m->no_jobs; i++){
-		kill(m->jobs[i].pid, SIGKILL);
+		kill(m->jobs[i]->pid, SIGKILL);
 	}
-	/* Cleanup history */
-	remove_all(m->head);
-	/* Free jobs array */
-	free(m->jobs);
-	m->jobs = NULL;
+	/* Detach from shared history */
+	shist_close();
+	/* Write latency stats */
+	stats_flush(TRUE);
 	/* Free shell struct */
 	free(m);
 	m = NULL;
 
-	return EXIT_SUCCESS;
+	return status;
 }
 
 /*
@@ -71,24 +96,103 @@ int main() {
 void init(){
 
 	/* Initialize mysh info struct */
-	m = (struct mysh*) malloc(sizeof(struct mysh));
-	m->signal_flag = FALSE;
-	strcpy(m->cur_user, getenv("USER"));
-	m->head = NULL;
-	m->jobs = (job*)malloc(sizeof(job));
-
-	if(m->jobs == NULL) {
+	m = (struct mysh*) mysh_malloc(sizeof(struct mysh));
+	if(m == NULL) {
 		fprintf(stderr, "ERROR(init): Failed to allocate memory\n");
 		exit(EXIT_FAILURE);
 	}
+	m->signal_flag = FALSE;
+	snprintf(m->cur_user, sizeof(m->cur_user), "%s", getenv("USER") ? getenv("USER") : "");
+	m->hist_saved = FALSE;
+
+	/* Duplicate handling, as in bash */
+	char *hist_control = getenv("HISTCONTROL");
+	m->hist_control = 0;
+	if(hist_control != NULL){
+		if(strstr(hist_control, "ignoredups") || strstr(hist_control, "ignoreboth")){
+			m->hist_control |= HIST_IGNOREDUPS;
+		}
+		if(strstr(hist_control, "erasedups")){
+			m->hist_control |= HIST_ERASEDUPS;
+		}
+	}
+
+	/* History shared with other sessions, opt-in */
+	char *shist_name = getenv("MYSH_SHARED_HISTORY");
+	m->shist = NULL;
+	if(shist_name != NULL && shist_name[0]){
+		shist_open(shist_name);
+	}
+
+	/* Allocators: per command arena, pools for jobs */
+	m->arena.head = NULL;
+	m->arena.cur = NULL;
+	m->arena.maps = NULL;
+	pool_init(&m->job_pool, sizeof(job));
+	pool_init(&m->qjob_pool, sizeof(qjob));
 
 	m->no_jobs = 0;
 
+	/* Background jobs inherit the shell's placement until a policy is set */
+	init_placement(&m->place);
+	m->rr_next = -1;
+
+	/* Background job queue, off until enabled with the queue builtin */
+	m->no_queued = 0;
+	m->queue_seq = 0;
+	m->queue_on = FALSE;
+	m->queue_stalled = FALSE;
+	m->max_running = sysconf(_SC_NPROCESSORS_ONLN);
+	m->max_cpu_psi = 80.0;
+	m->max_mem_psi = 20.0;
+	m->fg_pid = 0;
+	m->fg_status = 0;
+
+	/* Command latency stats, on when written to a file */
+	memset(m->stats, 0, sizeof(m->stats));
+	m->no_stats = 0;
+	pool_init(&m->stats_pool, sizeof(cmd_stats));
+	m->stats_file = getenv("MYSH_STATS_FILE");
+	m->stats_on = (m->stats_file != NULL);
+	m->stats_written = time(NULL);
+	m->fg_end = 0;
+
+	/* Directory listings for globbing, read on first use */
+	memset(m->dcache, 0, sizeof(m->dcache));
+	m->dcache_tick = 0;
+	m->dcache_hits = 0;
+	m->dcache_misses = 0;
+
+	/* Line editing and completion when run in a terminal */
+	m->tty = (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &m->tty_saved) == 0);
+	memset(m->pindex, 0, sizeof(m->pindex));
+	m->no_pindex = 0;
+
+	/* Argument batching, off until enabled with the batch builtin */
+	m->glob_first = -1;
+	m->glob_last = -1;
+	m->batch_on = FALSE;
+	m->batch_jobs = 1;
+	m->no_batch_running = 0;
+	m->batch_code = 0;
+	m->batch_failed = 0;
+
+	/* Background jobs write to the terminal until set with the output builtin */
+	m->mux_mode = MUX_OFF;
+	deadline_init(&m->fg_deadline);
+	m->vars = NULL;
+	m->vars_cap = 0;
+	m->no_vars = 0;
+	m->term_fd = -1;
+
 	/* Initialize signal handler */
 	if(signal(SIGINT, &sighandler) == SIG_ERR){
 		fprintf(stderr, "ERROR: Could not set signal handler\n");
 		exit(EXIT_FAILURE);
 	}
+
+	/* Initialize child event handling */
+	ev_init();
 }
 
 
@@ -96,36 +200,33 @@ void init(){
  * Function:  loop
  * --------------------
  *  Main loop of the shell that does the following: 
- *  1: Delete non-existing jobs/processes from the jobs-array. (using kill and remove_job)
- *  2: Print prompt 
- *  3: Read input (using read_stdin)
- *  4: Save the command (using save_command)
- *  5: Split input to tokens (using strtok_param)
- *  6: Parse tokens and execute command (using param_parser)
+ *  1: Print prompt 
+ *  2: Read input (using read_stdin)
+ *  3: Save the command (using save_command)
+ *  4: Split input to tokens and expand globs (using split_line)
+ *  5: Parse tokens and execute command (using param_parser)
+ *
+ *  Finished jobs are reaped and queued jobs admitted by the event loop while reading
+ *  input or waiting for a foreground command. (using ev_poll)
  */
 void loop() {
 
 	/* Input line buffer*/
 	char input[INPUT_BUFSIZE];
-	/* Split input line to parameters */
-	char *param[PARAMS_BUFSIZE];
+	/* Split input line to parameters, in the arena */
+	char **param;
 	/* Command counter for prompt */
 	int prompt_counter = 0;
 
 	/* Main loop */
 	while(TRUE){
 
-		/* Remove non-existing jobs from array */
-		for(int i = 0; i < m->no_jobs; i++){
-			if(kill(m->jobs[i].pid, 0) == -1){
-				remove_job(m->jobs[i].pid);
-				m->no_jobs--;
-				m->jobs = (job*)realloc(m->jobs, (m->no_jobs) * sizeof(job));
-			}
-		}
+		/* Release memory of the previous command */
+		arena_reset(&m->arena);
 
 		/* Print prompt */
-		printf("%s@mysh %d> ", getenv("USER"), prompt_counter);
+		snprintf(m->prompt, sizeof(m->prompt), "%s@mysh %d> ", getenv("USER"), prompt_counter);
+		printf("%s", m->prompt);
 
 		/* Read input */
 		if(!read_stdin(input)){
@@ -133,24 +234,23 @@ void loop() {
 		}
 
 		/* Save command */
-		if(save_command(input) == -1){
+		while(save_command(input) == -1){
 			/* Remove last element in history */
-			do{
-				md *delete_me = pop(m->head);
-				/* Clear bits and free memory */
-				for(int j = 0; delete_me->d_index[j] >= 0; j++){
-					free_bit(h_m.bm, delete_me->d_index[j]);
-					int hist_index = delete_me->d_index[j]*BLOCK_SIZE;
-					memset(&h_m.hist[hist_index], '\0', BLOCK_SIZE);
-				}
-				free(delete_me);
-			}while(save_command(input) == -1);
+			if(hist_evict() == -1){
+				break;
+			}
 		}
 
-		int no_tokens;
-
 		/* Split input to tokens */
-		no_tokens = strtok_param(input, param);
+		uint64_t parse_start = stats_now();
+		int no_tokens = split_line(input, &param);
+		if(no_tokens == -1){
+			fprintf(stderr, "ERROR: Failed to allocate memory\n");
+			continue;
+		}
+		if(m->stats_on && param[0]){
+			stats_record(param[0], STAT_PARSE, stats_now() - parse_start);
+		}
 
 		/* Increase command counter */
 		if(param[0]){
@@ -162,7 +262,13 @@ void loop() {
 			if(param_parser(param, no_tokens) == -1){
 				break;
 			}
+			stats_flush(FALSE);
 		}
+
+#ifdef DEBUG
+		fprintf(stderr, "DEBUG: Arena: %lu allocations, %zu bytes (high %zu, size %zu), %lu mallocs\n",
+				a_stats.arena_allocs, a_stats.arena_used, a_stats.arena_high, a_stats.arena_size, a_stats.mallocs);
+#endif
 	}
 }
 
@@ -170,7 +276,7 @@ void loop() {
 /*
  * Function:  read_stdin
  * --------------------
- *  Reads a line from stdin and stores in in *str.
+ *  Reads a line from stdin and stores in in *str. Child events are handled while waiting.
  *
  *  *lineptr: Pointer to allocated memory for the line.
  *
@@ -178,17 +284,19 @@ void loop() {
  */
 int read_stdin(char *lineptr){
 
-	/* Read input line and exit of CTRL-D is caught */
-	if(fgets(lineptr, sizeof(char) * INPUT_BUFSIZE, stdin) == NULL){
-		printf("\nCTRL-D caught, exiting mysh..\n");
-		return 0;
-	}
+	int len = read_line(lineptr, sizeof(char) * INPUT_BUFSIZE);
 
 	/* Signal */
 	if(m->signal_flag){
 		return 0;
 	}
 
+	/* Exit if CTRL-D is caught */
+	if(len <= 0){
+		printf("\nCTRL-D caught, exiting mysh..\n");
+		return 0;
+	}
+
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: Read: %s", lineptr);
 #endif
@@ -199,32 +307,50 @@ int read_stdin(char *lineptr){
 /*
  * Function: strtok_param
  * --------------------
- *  Breaks a string into sequences of tokens, i.e splits a line into words. Last index saved to saveptr is NULL.
+ *  Breaks a string into sequences of tokens, i.e splits a line into words. The tokens point
+ *  into str, the array of tokens is allocated in the command arena. Last index is NULL.
  *
  *  *str: Line to be split
- *  **saveptr: Pointer to where the tokens will be saved.
+ *  ***saveptr: Pointer to where the token array will be saved.
  *
- *  returns: Number of tokens, 0 if no tokens.
+ *  returns: Number of tokens, 0 if no tokens, -1 if out of memory.
  */
-int strtok_param(char *str, char **saveptr){
+int strtok_param(char *str, char ***saveptr){
 
 	char *token;
+	char *state;
 	int pos = 0;
+	int cap = PARAMS_BUFSIZE;
+	char **tokens = arena_alloc(&m->arena, cap * sizeof(char*));
+
+	if(tokens == NULL){
+		return -1;
+	}
 
-	/* Save word-pointers to saveptr using strtok */
-	token = strtok(str, ARGS_DELIM);
+	/* Save word-pointers to tokens using strtok, growing the array when full */
+	token = strtok_r(str, ARGS_DELIM, &state);
 
 	while(token != NULL){
-		saveptr[pos++] = token;
-		token = strtok(NULL, ARGS_DELIM);
+		if(pos + 1 >= cap){
+			char **grown = arena_alloc(&m->arena, 2 * cap * sizeof(char*));
+			if(grown == NULL){
+				return -1;
+			}
+			memcpy(grown, tokens, pos * sizeof(char*));
+			tokens = grown;
+			cap *= 2;
+		}
+		tokens[pos++] = token;
+		token = strtok_r(NULL, ARGS_DELIM, &state);
 	}
 
-	saveptr[pos] = NULL;
+	tokens[pos] = NULL;
+	*saveptr = tokens;
 
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: Number of tokens saved to saveptr: %d\n", pos);
-	for(int i = 0; saveptr[i]; i++){
-		fprintf(stderr, "DEBUG: [%d]: %s\n", i, saveptr[i]);
+	for(int i = 0; tokens[i]; i++){
+		fprintf(stderr, "DEBUG: [%d]: %s\n", i, tokens[i]);
 	}
 #endif
 
@@ -232,6 +358,53 @@ int strtok_param(char *str, char **saveptr){
 }
 
 
+/*
+ * Function: split_line
+ * --------------------
+ *  Splits a command line into words as typed at the prompt: with substitution
+ *  (subst_split) when the line needs it, else strtok_param, then globs are expanded.
+ *
+ *  *line: Line to be split, changed in place
+ *  ***param: Pointer to where the token array will be saved.
+ *
+ *  returns: Number of tokens, 0 if no tokens or on error, -1 if out of memory.
+ */
+int split_line(char *line, char ***param){
+
+	int no_tokens;
+	if(subst_needed(line)){
+		no_tokens = subst_split(line, param);
+	}
+	else{
+		no_tokens = strtok_param(line, param);
+	}
+	if(no_tokens > 0){
+		no_tokens = glob_expand(param, no_tokens);
+	}
+	return no_tokens;
+}
+
+
+/*
+ * Function: builtin_index
+ * --------------------
+ *  Finds a builtin command.
+ *
+ *  *cmd: Command name
+ *
+ *  returns: Index in builtins, -1 if not a builtin.
+ */
+int builtin_index(const char *cmd){
+
+	for(int i = 0; i < NO_BUILTINS; i++){
+	    if(strcmp(cmd, builtins_cmds[i]) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+
 /*
  * Function: param_parser
  * --------------------
@@ -249,11 +422,100 @@ int param_parser(char **param, int no_params){
 		return 0;
 	}
 
+	return run_command(param, no_params, builtin_index(param[0]), NULL);
+}
+
+
+/*
+ * Function: run_command
+ * --------------------
+ *  Runs a command that is already resolved: a fan-out, a builtin, or an executable in a
+ *  child using fork, in the background if the last parameter is '&'. Assignments before
+ *  the command are done first.
+ *
+ *  param: Array with parameters in each index
+ *  no_params: Number of parameters in param
+ *  builtin: Index of the builtin, -1 if not a builtin
+ *  *path: Executable to run, NULL to search PATH
+ *
+ *  returns: 0 succsess or nothing done, 1 if quit and -1 on fork error.
+ */
+int run_command(char **param, int no_params, int builtin, const char *path){
+
+	/* Leading 'NAME=value' words set variables, the rest is the command */
+	int assigned = var_assign(param);
+	if(assigned){
+		param += assigned;
+		no_params -= assigned;
+		if(param[0] == NULL){
+			return 0;
+		}
+		builtin = builtin_index(param[0]);
+		path = NULL;
+
+		/* Glob expanded arguments are counted from the command */
+		if(m->glob_last < assigned){
+			m->glob_first = -1;
+			m->glob_last = -1;
+		}
+		else if(m->glob_first != -1){
+			m->glob_first = m->glob_first < assigned ? 0 : m->glob_first - assigned;
+			m->glob_last -= assigned;
+		}
+	}
+
+	/* Producer and targets of a fan-out */
+	if(fanout_index(param) != -1){
+		return fanout_run(param, no_params);
+	}
+
 	/* Run if builtin */
-	for(int i = 0; i < NO_BUILTINS; i++){
-	    if(strcmp(param[0], builtins_cmds[i]) == 0){
-			return builtins[i](param);
+	if(builtin != -1){
+		/* Exit status 1 on error, a builtin that runs a command sets its status */
+		uint64_t start = stats_now();
+		m->fg_status = 0;
+		int ret = builtins[builtin](param);
+		if(ret == 1){
+			m->fg_status = 1 << 8;
+		}
+		if(m->stats_on && start){
+			stats_record(param[0], STAT_RUN, stats_now() - start);
 		}
+		return ret;
+	}
+
+	/* Background: start now, or queue for admission */
+	if(strcmp(param[no_params - 1], BG_SIGN) == 0){
+		param[no_params - 1] = NULL;
+		if(no_params == 1){
+			return 0;
+		}
+		if(m->queue_on){
+			unsigned long seq = m->queue_seq;
+			if(queue_job(param, &m->place) == -1){
+				fprintf(stderr, "ERROR: Unable to queue job\n");
+				return 0;
+			}
+			admit_jobs();
+			for(int i = 0; i < m->no_queued; i++){
+				if(m->queue[i]->seq == seq){
+					printf("[q%lu] queued\n", seq + 1);
+				}
+			}
+			return 0;
+		}
+		return launch_job(param, &m->place);
+	}
+
+	uint64_t start = stats_now();
+
+	/* Too many arguments for one execve: split them */
+	if(batch_needed(param, no_params)){
+		int ret = batch_run(param, no_params);
+		if(start){
+			stats_record(param[0], STAT_RUN, stats_now() - start);
+		}
+		return ret;
 	}
 
 	pid_t pid_cmd;
@@ -261,16 +523,10 @@ int param_parser(char **param, int no_params){
 
 	/* Child */
 	if(pid_cmd == 0){
-		/* Background flag */
-		if(strcmp(param[no_params - 1], BG_SIGN) == 0){
-			param[no_params - 1] = NULL;
-			setpgid(pid_cmd, 0);
-			if(!exec_command(param[0], param)){
-				exit(EXIT_SUCCESS);
-			}
-			exit(EXIT_FAILURE);
+		if(path != NULL){
+			char *envp[] = { NULL };
+			execve(path, param, envp);
 		}
-		/* No background flag */
 		if(!exec_command(param[0], param)){
 			exit(EXIT_SUCCESS);
 		}
@@ -283,17 +539,95 @@ int param_parser(char **param, int no_params){
 	}
 	/* Parent */
 	else{
-		if(strcmp(param[no_params - 1], BG_SIGN) == 0){
-			save_job(pid_cmd, param);
-			printf("[%ld] %d\n", m->no_jobs, pid_cmd);
-			return 0;
+		uint64_t launched = stats_now();
+		wait_fg(pid_cmd);
+		if(start){
+			stats_record(param[0], STAT_LAUNCH, launched - start);
+			stats_record(param[0], STAT_WAIT, stats_now() - launched);
+			stats_record(param[0], STAT_RUN, m->fg_end - start);
 		}
-		wait(NULL);
 		return 0;
 	}
 }
 
 
+/*
+ * Function: launch_job
+ * --------------------
+ *  Starts a background job in its own process group with the given placement policy
+ *  and adds it to the job array.
+ *
+ *  **param: Command and arguments, without '&'
+ *  *policy: Placement policy for the job
+ *
+ *  returns: 0 on succsess, -1 on fork error.
+ */
+int launch_job(char **param, placement *policy){
+
+	/* Resolve placement before fork so round-robin advances in the shell */
+	placement pl;
+	if(resolve_placement(policy, &pl) == -1){
+		fprintf(stderr, "mysh: place: no usable cpu in placement policy, running unplaced\n");
+		init_placement(&pl);
+	}
+
+	/* Pipe for the job's output when multiplexed */
+	int out[2];
+	if(mux_pipe(out) == -1){
+		return 0;
+	}
+
+	uint64_t start = stats_now();
+	pid_t pid_cmd;
+	pid_cmd = fork();
+
+	/* Child */
+	if(pid_cmd == 0){
+		setpgid(0, 0);
+		apply_placement(0, &pl);
+		if(out[1] != -1){
+			dup2(out[1], STDOUT_FILENO);
+			dup2(out[1], STDERR_FILENO);
+		}
+		if(!exec_command(param[0], param)){
+			exit(EXIT_SUCCESS);
+		}
+		exit(EXIT_FAILURE);
+	}
+	/* Fork failed */
+	else if(pid_cmd < 0){
+		fprintf(stderr, "ERROR: Unable to fork");
+		if(out[0] != -1){
+			close(out[0]);
+			close(out[1]);
+		}
+		return -1;
+	}
+
+	/* Parent */
+	if(out[1] != -1){
+		close(out[1]);
+	}
+	if(start){
+		stats_record(param[0], STAT_LAUNCH, stats_now() - start);
+	}
+	if(save_job(pid_cmd, param, &pl)){
+		fprintf(stderr, "mysh: job table full, %d not tracked\n", pid_cmd);
+		if(out[0] != -1){
+			close(out[0]);
+		}
+		return 0;
+	}
+	m->jobs[m->no_jobs - 1]->start = start;
+	if(out[0] != -1){
+		mux_attach(m->jobs[m->no_jobs - 1], out[0], m->no_jobs);
+	}
+	printf("[%ld] %d\n", m->no_jobs, pid_cmd);
+	fflush(stdout);
+	return 0;
+}
+
+
 /*
  * Function: exec_command
  * --------------------
@@ -302,7 +636,7 @@ int param_parser(char **param, int no_params){
  *  *cmd: Executable/command to run
  *  *argv[]: Executable arguments
  *
- *  returns: 0 on succsessful execve, 1 if executable does not exists.
+ *  returns: Only on error: 1 if executable does not exists or execve failed.
  */
 int exec_command(char *cmd, char *argv[]){
 
@@ -317,7 +651,8 @@ int exec_command(char *cmd, char *argv[]){
 		/* Run executable if fond */
 		if(access(filename,F_OK) != -1 ){
 			execve(filename, argv , envp);
-			return 0;
+			fprintf(stderr, "mysh: %s: %s\n", cmd, errno == E2BIG ? "Argument list too long" : strerror(errno));
+			return 1;
 		}
 	}
 
@@ -358,53 +693,65 @@ void debug_datablocks(char *a){
 /*
  * Function: save_command
  * --------------------
- *  Save the command to history. Allocates needed blocks and sets bits in bitmap.
+ *  Save the command to history. The command is front coded against the previous command,
+ *  the rest is stored in a run of blocks and the bits set in the bitmap. Duplicates are
+ *  skipped or erased according to $HISTCONTROL.
  *
  *  *line: Command line to save.
  *
- *  returns: 0 on success, 1 if line was empty, -1 when not enough available blocks.
+ *  returns: 0 on success, 1 if line was empty or a duplicate, -1 when not enough available blocks.
  */
 int save_command(char *line){
 
-	/* Number of blocks to allocate the line in */
-	int num_blocks = 0;
-	int d_i[15];
-	memset(d_i, -1, sizeof(d_i));
-	size_t line_len = strlen(line) -1;
-	int l = 0;
+	size_t line_len = strcspn(line, "\n");
+	uint32_t hash = hist_hash(line, line_len);
+	md new_md;
+
+	m->hist_saved = FALSE;
 
 	/* Return if empty line */
 	if(!line_len){
 		return 1;
 	}
 
-	/* Calculate number of blocks to use */
-	while(line_len > num_blocks*8){
-		num_blocks++;
+	/* Skip repeat of the previous command */
+	if((m->hist_control & HIST_IGNOREDUPS) && hist_equal(0, line, line_len, hash)){
+		return 1;
 	}
 
-	/* Test for block allocation */
-	if(!test_n_free_bit(h_m.bm, num_blocks)){
+	/* Erase older copies */
+	if(m->hist_control & HIST_ERASEDUPS){
+		for(int n = 0; n < h_m.no_md; n++){
+			if(hist_equal(n, line, line_len, hash)){
+				hist_remove(n--);
+			}
+		}
+	}
+
+	if(h_m.no_md >= MAX_HISTORY){
 		return -1;
 	}
 
-	/* Save command */
-	for(int i = 0; i < num_blocks; i++){
-		/* Get block indexes */
-		d_i[i] = get_free_bit(h_m.bm);
-		/* Set bit */
-		set_bit(h_m.bm, d_i[i]);
-		/* Memory byte offset */
-		int x;
-		/* Allocate line to blocks */
-		for(x = 0; x < 8; x++){
-			if(line[l] == '\n'){
-				h_m.hist[d_i[i]*8 + x] = '\0';
-				break;
-			}
-			h_m.hist[d_i[i]*8 + x] = line[l];
-			l++;
+	/* Shared prefix with the previous command, bounded chain depth */
+	new_md.len = line_len;
+	new_md.hash = hash;
+	new_md.shared = 0;
+	new_md.depth = 0;
+	md *prev_md = md_get(0);
+	if(prev_md != NULL && prev_md->depth < HIST_MAX_DEPTH){
+		char prev[INPUT_BUFSIZE];
+		int prev_len = hist_decode(0, prev);
+		while(new_md.shared < prev_len && new_md.shared < line_len && prev[new_md.shared] == line[new_md.shared]){
+			new_md.shared++;
 		}
+		if(new_md.shared){
+			new_md.depth = prev_md->depth + 1;
+		}
+	}
+
+	/* Save command */
+	if(hist_store(&new_md, line) == -1){
+		return -1;
 	}
 
 #ifdef DEBUG
@@ -412,7 +759,9 @@ int save_command(char *line){
 	debug_datablocks(h_m.hist);
 #endif
 
-	push(&m->head, line_len, d_i);
+	*md_push() = new_md;
+	m->hist_saved = TRUE;
+	shist_append(line, line_len);
 	return 0;
 }
 
@@ -424,24 +773,43 @@ int save_command(char *line){
  *
  *  pid: Pid of the process.
  *  **cmd: Command entered.
+ *  *pl: Placement the job was started with.
  *
- *  returns: 0 on succsess, 1 if job not found.
+ *  returns: 0 on succsess, 1 if the job array is full.
  */
-int save_job(pid_t pid, char **cmd){
+int save_job(pid_t pid, char **cmd, placement *pl){
 
-	job new_job;
+	if(m->no_jobs >= MAX_JOBS){
+		return 1;
+	}
+
+	job *new_job = pool_alloc(&m->job_pool);
+	if(new_job == NULL){
+		return 1;
+	}
 
-	new_job.pid = pid;
-	new_job.cmd[0] = '\0';
+	new_job->pid = pid;
+	new_job->place = *pl;
+	new_job->cmd[0] = '\0';
+	new_job->start = 0;
+	new_job->out_fd = -1;
+	new_job->out_mode = MUX_OFF;
+	new_job->tag[0] = '\0';
+	new_job->out = NULL;
+	new_job->out_len = 0;
+	new_job->out_size = 0;
+	deadline_init(&new_job->timer);
 
 	/* Save command entered, exclude '&' */
+	size_t len = 0;
 	for(int i = 0; cmd[i] && (strcmp(cmd[i], BG_SIGN) != 0); i++){
-		strcat(new_job.cmd, cmd[i]);
 		/* Fix missing space */
-		strcat(new_job.cmd, " ");
+		len += snprintf(new_job->cmd + len, INPUT_BUFSIZE - len, "%s ", cmd[i]);
+		if(len >= INPUT_BUFSIZE){
+			break;
+		}
 	}
 
-	m->jobs = (job*)realloc(m->jobs, (m->no_jobs + 1) * sizeof(job));
 	m->jobs[m->no_jobs] = new_job;
 	m->no_jobs += 1;
 
@@ -452,7 +820,7 @@ int save_job(pid_t pid, char **cmd){
 /*
  * Function: remove_job
  * --------------------
- *  Removes a job from the job array. (NO FREE)
+ *  Removes a job from the job array, releases its cgroup leaf and returns it to the job pool.
  *
  *  pid: Pid of the job to remove from array.
  *
@@ -460,17 +828,18 @@ int save_job(pid_t pid, char **cmd){
  */
 int remove_job(pid_t pid){
 
-	int pos = 0;
-
 	/* Find pid */
 	for(int i = 0 ;i < m->no_jobs; i++){
-		if(m->jobs[i].pid == pid){
+		if(m->jobs[i]->pid == pid){
+			mux_flush(m->jobs[i]);
+			deadline_clear(&m->jobs[i]->timer);
+			release_placement(pid, &m->jobs[i]->place);
+			pool_free(&m->job_pool, m->jobs[i]);
 			/* Remove from array */
-			for(i = pos - 1; i < m->no_jobs - 1; i++){
+			for(; i < m->no_jobs - 1; i++){
 				m->jobs[i] = m->jobs[i+1];
 			}
 			m->no_jobs--;
-			m->jobs = (job*)realloc(m->jobs, (m->no_jobs) * sizeof(job));
 			return 0;
 		}
 	}
@@ -0,0 +1,469 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* IO priority interface (linux/ioprio.h) */
+#define IOPRIO_WHO_PROCESS 	1
+#define IOPRIO_CLASS_SHIFT 	13
+/* NUMA memory policy (linux/mempolicy.h) */
+#define MPOL_PREFERRED 		1
+
+/* IO priority class names, indexed by class */
+static char *io_classes[] = { "none", "rt", "be", "idle" };
+
+
+/*
+ * Function: parse_cpulist
+ * --------------------
+ *  Parses a cpu list on the form used by sysfs and taskset, e.g "0-3,8,10-11".
+ *
+ *  *str: Cpu list to parse
+ *  *set: Cpu set to store the result in
+ *
+ *  returns: 0 on success, -1 on malformed list or empty set.
+ */
+int parse_cpulist(const char *str, cpu_set_t *set){
+
+	CPU_ZERO(set);
+
+	while(*str && *str != '\n'){
+		char *end;
+		long lo = strtol(str, &end, 10);
+		long hi = lo;
+		if(end == str || lo < 0){
+			return -1;
+		}
+		if(*end == '-'){
+			str = end + 1;
+			hi = strtol(str, &end, 10);
+			if(end == str || hi < lo){
+				return -1;
+			}
+		}
+		if(hi >= CPU_SETSIZE){
+			return -1;
+		}
+		for(long i = lo; i <= hi; i++){
+			CPU_SET(i, set);
+		}
+		str = end;
+		if(*str == ','){
+			str++;
+		}
+		else if(*str && *str != '\n'){
+			return -1;
+		}
+	}
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+
+/*
+ * Function: format_cpulist
+ * --------------------
+ *  Formats a cpu set as a compact cpu list, e.g "0-3,8".
+ *
+ *  *set: Cpu set to format
+ *  *buf: Buffer to write to
+ *  len: Size of buf
+ */
+void format_cpulist(cpu_set_t *set, char *buf, size_t len){
+
+	size_t pos = 0;
+	buf[0] = '\0';
+
+	for(int i = 0; i < CPU_SETSIZE && pos < len; i++){
+		if(!CPU_ISSET(i, set)){
+			continue;
+		}
+		int j = i;
+		while(j + 1 < CPU_SETSIZE && CPU_ISSET(j + 1, set)){
+			j++;
+		}
+		if(j == i){
+			pos += snprintf(buf + pos, len - pos, "%s%d", pos ? "," : "", i);
+		}
+		else{
+			pos += snprintf(buf + pos, len - pos, "%s%d-%d", pos ? "," : "", i, j);
+		}
+		i = j;
+	}
+}
+
+
+/*
+ * Function: node_cpus
+ * --------------------
+ *  Reads the cpus belonging to a NUMA node from sysfs.
+ *
+ *  node: NUMA node number
+ *  *set: Cpu set to store the node cpus in
+ *
+ *  returns: 0 on success, -1 if the node does not exist.
+ */
+int node_cpus(int node, cpu_set_t *set){
+
+	char path[PATH_BUFSIZE];
+	char list[INPUT_BUFSIZE*4];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return -1;
+	}
+	if(fgets(list, sizeof(list), f) == NULL){
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	return parse_cpulist(list, set);
+}
+
+
+/*
+ * Function: resolve_placement
+ * --------------------
+ *  Turns a placement policy into the concrete placement of a new job. For round-robin
+ *  policies the next cpu of the pool is picked and the shell's round-robin cursor advanced.
+ *
+ *  *policy: Policy to resolve
+ *  *out: Resolved placement
+ *
+ *  returns: 0 on success, -1 if the policy selects no usable cpu.
+ */
+int resolve_placement(placement *policy, placement *out){
+
+	*out = *policy;
+
+	if(policy->cpu_mode == PLACE_CPU_NONE && policy->node < 0){
+		return 0;
+	}
+
+	/* Cpu pool: explicit set, or what the shell itself may run on */
+	cpu_set_t pool;
+	if(policy->cpu_mode != PLACE_CPU_NONE && CPU_COUNT(&policy->cpus)){
+		pool = policy->cpus;
+	}
+	else if(sched_getaffinity(0, sizeof(pool), &pool) == -1){
+		return -1;
+	}
+
+	/* Restrict to the NUMA node */
+	if(policy->node >= 0){
+		cpu_set_t node_set;
+		if(node_cpus(policy->node, &node_set) == -1){
+			return -1;
+		}
+		CPU_AND(&pool, &pool, &node_set);
+	}
+
+	if(!CPU_COUNT(&pool)){
+		return -1;
+	}
+
+	out->cpu_mode = PLACE_CPU_SET;
+	out->cpus = pool;
+
+	/* Pick the next cpu in the pool after the last one handed out */
+	if(policy->cpu_mode == PLACE_CPU_RR){
+		int cpu = m->rr_next;
+		for(int i = 0; i < CPU_SETSIZE; i++){
+			cpu = (cpu + 1) % CPU_SETSIZE;
+			if(CPU_ISSET(cpu, &pool)){
+				break;
+			}
+		}
+		m->rr_next = cpu;
+		CPU_ZERO(&out->cpus);
+		CPU_SET(cpu, &out->cpus);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Function: apply_placement
+ * --------------------
+ *  Applies a resolved placement to a process. Failures are reported, but do not stop
+ *  the remaining parts of the placement from being applied.
+ *
+ *  pid: Process to place, 0 for the calling process.
+ *  *pl: Resolved placement, its cgroup is cleared if the process was not moved there
+ *
+ *  returns: 0 on success, -1 if any part of the placement failed.
+ */
+int apply_placement(pid_t pid, placement *pl){
+
+	int ret = 0;
+	pid_t self = pid ? pid : getpid();
+
+	if(pl->cpu_mode != PLACE_CPU_NONE){
+		if(sched_setaffinity(pid, sizeof(pl->cpus), &pl->cpus) == -1){
+			perror("mysh: place: sched_setaffinity");
+			ret = -1;
+		}
+	}
+
+	/* Memory policy can only be set for the calling process */
+	if(pl->node >= 0 && pid == 0){
+		unsigned long nodemask = 1UL << pl->node;
+		if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask)*8) == -1){
+			perror("mysh: place: set_mempolicy");
+			ret = -1;
+		}
+	}
+
+	if(pl->nice != PLACE_NICE_NONE){
+		if(setpriority(PRIO_PROCESS, pid, pl->nice) == -1){
+			perror("mysh: place: setpriority");
+			ret = -1;
+		}
+	}
+
+	if(pl->io_class){
+		int ioprio = (pl->io_class << IOPRIO_CLASS_SHIFT) | pl->io_level;
+		if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio) == -1){
+			perror("mysh: place: ioprio_set");
+			ret = -1;
+		}
+	}
+
+	/* Move the process to its own cgroup leaf, removed again if the move fails */
+	if(pl->cgroup[0]){
+		char path[PATH_BUFSIZE + 32];
+		snprintf(path, sizeof(path), "%s/job-%d", pl->cgroup, self);
+		if(mkdir(path, 0755) == -1){
+			perror("mysh: place: cgroup");
+			pl->cgroup[0] = '\0';
+			return -1;
+		}
+		size_t len = strlen(path);
+		strncat(path, "/cgroup.procs", sizeof(path) - len - 1);
+		FILE *f = fopen(path, "w");
+		int failed = (f == NULL);
+		if(f != NULL){
+			failed = fprintf(f, "%d\n", self) < 0;
+			failed |= (fclose(f) == EOF);
+		}
+		if(failed){
+			perror("mysh: place: cgroup.procs");
+			path[len] = '\0';
+			rmdir(path);
+			pl->cgroup[0] = '\0';
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+
+/*
+ * Function: release_placement
+ * --------------------
+ *  Removes the cgroup leaf of a finished job. The leaf is only removed when empty.
+ *
+ *  pid: Pid of the job
+ *  *pl: Placement of the job
+ */
+void release_placement(pid_t pid, placement *pl){
+
+	if(pl->cgroup[0]){
+		char path[PATH_BUFSIZE + 32];
+		snprintf(path, sizeof(path), "%s/job-%d", pl->cgroup, pid);
+		rmdir(path);
+	}
+}
+
+
+/*
+ * Function: format_placement
+ * --------------------
+ *  Formats a placement as a human readable string.
+ *
+ *  *pl: Placement to format
+ *  *buf: Buffer to write to
+ *  len: Size of buf
+ */
+void format_placement(placement *pl, char *buf, size_t len){
+
+	char cpus[INPUT_BUFSIZE];
+	size_t pos = 0;
+
+	format_cpulist(&pl->cpus, cpus, sizeof(cpus));
+
+	if(pl->cpu_mode == PLACE_CPU_RR){
+		pos += snprintf(buf + pos, len - pos, "cpus=rr%s%s", cpus[0] ? ":" : "", cpus);
+	}
+	else{
+		pos += snprintf(buf + pos, len - pos, "cpus=%s", pl->cpu_mode == PLACE_CPU_NONE ? "any" : cpus);
+	}
+	if(pl->node >= 0 && pos < len){
+		pos += snprintf(buf + pos, len - pos, " node=%d", pl->node);
+	}
+	if(pl->nice != PLACE_NICE_NONE && pos < len){
+		pos += snprintf(buf + pos, len - pos, " nice=%d", pl->nice);
+	}
+	if(pl->io_class && pos < len){
+		pos += snprintf(buf + pos, len - pos, " io=%s:%d", io_classes[pl->io_class], pl->io_level);
+	}
+	if(pl->cgroup[0] && pos < len){
+		snprintf(buf + pos, len - pos, " cgroup=%s", pl->cgroup);
+	}
+}
+
+
+/*
+ * Function: init_placement
+ * --------------------
+ *  Initializes a placement that leaves everything as inherited from the shell.
+ *
+ *  *pl: Placement to initialize
+ */
+void init_placement(placement *pl){
+
+	memset(pl, 0, sizeof(*pl));
+	pl->cpu_mode = PLACE_CPU_NONE;
+	pl->node = -1;
+	pl->nice = PLACE_NICE_NONE;
+}
+
+
+/*
+ * Function: parse_placement_opt
+ * --------------------
+ *  Applies one option of the place builtin to a placement.
+ *
+ *  opt: Option letter
+ *  *val: Option value, "none" resets the option.
+ *  *pl: Placement to modify
+ *
+ *  returns: 0 on success, -1 on bad value.
+ */
+int parse_placement_opt(char opt, char *val, placement *pl){
+
+	int none = (strcmp(val, "none") == 0);
+	char *end;
+
+	switch(opt){
+		case 'c':
+			if(none){
+				pl->cpu_mode = PLACE_CPU_NONE;
+				CPU_ZERO(&pl->cpus);
+				return 0;
+			}
+			if(strncmp(val, "rr", 2) == 0){
+				pl->cpu_mode = PLACE_CPU_RR;
+				CPU_ZERO(&pl->cpus);
+				if(val[2] == ':'){
+					return parse_cpulist(val + 3, &pl->cpus);
+				}
+				return val[2] ? -1 : 0;
+			}
+			pl->cpu_mode = PLACE_CPU_SET;
+			return parse_cpulist(val, &pl->cpus);
+		case 'm':
+			if(none){
+				pl->node = -1;
+				return 0;
+			}
+			pl->node = strtol(val, &end, 10);
+			if(*end || pl->node < 0 || pl->node >= (int)(sizeof(unsigned long)*8)){
+				pl->node = -1;
+				return -1;
+			}
+			return 0;
+		case 'n':
+			if(none){
+				pl->nice = PLACE_NICE_NONE;
+				return 0;
+			}
+			pl->nice = strtol(val, &end, 10);
+			if(*end || pl->nice < -20 || pl->nice > 19){
+				pl->nice = PLACE_NICE_NONE;
+				return -1;
+			}
+			return 0;
+		case 'i':
+			pl->io_class = 0;
+			pl->io_level = 0;
+			if(none){
+				return 0;
+			}
+			for(int i = 1; i < 4; i++){
+				size_t n = strlen(io_classes[i]);
+				if(strncmp(val, io_classes[i], n) == 0 && (val[n] == '\0' || val[n] == ':')){
+					pl->io_class = i;
+					if(val[n] == ':'){
+						pl->io_level = strtol(val + n + 1, &end, 10);
+						if(*end || pl->io_level < 0 || pl->io_level > 7){
+							pl->io_class = 0;
+							return -1;
+						}
+					}
+					else{
+						pl->io_level = 4;
+					}
+					return 0;
+				}
+			}
+			return -1;
+		case 'g':
+			pl->cgroup[0] = '\0';
+			if(none){
+				return 0;
+			}
+			if(strlen(val) >= sizeof(pl->cgroup) - 32){
+				return -1;
+			}
+			strcpy(pl->cgroup, val);
+			return 0;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Function: job_last_cpu
+ * --------------------
+ *  Reads the cpu a process last ran on from /proc/<pid>/stat.
+ *
+ *  pid: Pid of the process
+ *
+ *  returns: Cpu number, or -1 if unavailable.
+ */
+int job_last_cpu(pid_t pid){
+
+	char path[PATH_BUFSIZE];
+	char stat[PATH_BUFSIZE];
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return -1;
+	}
+	size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+	fclose(f);
+	stat[n] = '\0';
+
+	/* Fields after the command name, starting with field 3 (state) */
+	char *p = strrchr(stat, ')');
+	if(p == NULL){
+		return -1;
+	}
+	p++;
+
+	/* Processor is field 39 */
+	int field = 2;
+	char *tok = strtok(p, " ");
+	while(tok != NULL && ++field < 39){
+		tok = strtok(NULL, " ");
+	}
+
+	return tok ? atoi(tok) : -1;
+}
@@ -0,0 +1,507 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+
+/*
+ * Function: hash64
+ * --------------------
+ *  64 bit FNV-1a hash, of script contents and paths.
+ *
+ *  *data: Data to hash
+ *  len: Length of data
+ *
+ *  returns: Hash.
+ */
+static uint64_t hash64(const char *data, size_t len){
+
+	uint64_t hash = 14695981039346656037ull;
+	for(size_t i = 0; i < len; i++){
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+
+/*
+ * Function: buf_add
+ * --------------------
+ *  Appends to a growable buffer.
+ *
+ *  **buf: Buffer, NULL to start a new one
+ *  *len: Used bytes
+ *  *size: Size of buffer
+ *  *data: Data to append
+ *  n: Length of data
+ *
+ *  returns: Offset of the data in the buffer, -1 if out of memory.
+ */
+static long buf_add(char **buf, size_t *len, size_t *size, const void *data, size_t n){
+
+	if(*len + n > *size){
+		size_t new_size = *size ? *size : 1024;
+		while(*len + n > new_size){
+			new_size *= 2;
+		}
+		char *new_buf = mysh_realloc(*buf, new_size);
+		if(new_buf == NULL){
+			return -1;
+		}
+		*buf = new_buf;
+		*size = new_size;
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+	return *len - n;
+}
+
+
+/*
+ * Function: resolve_command
+ * --------------------
+ *  Finds the executable a command would run, searching PATH like exec_command.
+ *
+ *  *cmd: Command
+ *  *path: Buffer of PATH_BUFSIZE for the executable
+ *
+ *  returns: 0 if found, -1 if not.
+ */
+static int resolve_command(const char *cmd, char *path){
+
+	char dirs[PATH_BUFSIZE*4];
+	char *state;
+	char *env = getenv("PATH");
+
+	snprintf(dirs, sizeof(dirs), "%s", env ? env : "");
+	for(char *dir = strtok_r(dirs, ":", &state); dir; dir = strtok_r(NULL, ":", &state)){
+		if(snprintf(path, PATH_BUFSIZE, "%s/%s", dir, cmd) < PATH_BUFSIZE && access(path, F_OK) != -1){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Function: cache_path
+ * --------------------
+ *  Cache file of a script: $XDG_CACHE_HOME/mysh (or ~/.cache/mysh) and the hash of the
+ *  script's real path. The directory is created if missing.
+ *
+ *  *script: Script
+ *  *cache: Buffer of PATH_BUFSIZE for the cache file
+ *
+ *  returns: 0 on success, -1 if there is no usable cache directory.
+ */
+static int cache_path(const char *script, char *cache){
+
+	char real[PATH_MAX];
+	char dir[PATH_BUFSIZE];
+	char *xdg = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+
+	if(realpath(script, real) == NULL){
+		return -1;
+	}
+
+	if(xdg != NULL && xdg[0]){
+		snprintf(dir, sizeof(dir), "%s", xdg);
+	}
+	else if(home != NULL && home[0]){
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	}
+	else{
+		return -1;
+	}
+	mkdir(dir, 0700);
+	strncat(dir, "/mysh", sizeof(dir) - strlen(dir) - 1);
+	if(mkdir(dir, 0700) == -1 && errno != EEXIST){
+		return -1;
+	}
+
+	int len = snprintf(cache, PATH_BUFSIZE, "%s/%016llx.msc", dir, (unsigned long long)hash64(real, strlen(real)));
+	return len < PATH_BUFSIZE ? 0 : -1;
+}
+
+
+/*
+ * Function: script_check
+ * --------------------
+ *  Checks that a compiled script is complete and all offsets are inside it.
+ *
+ *  *h: Compiled script
+ *  size: Size of the compiled script
+ *
+ *  returns: 1 if usable, 0 if not.
+ */
+static int script_check(script_hdr *h, size_t size){
+
+	if(size < sizeof(script_hdr) || h->magic != SCRIPT_MAGIC || h->version != SCRIPT_VERSION){
+		return FALSE;
+	}
+	if(size != sizeof(script_hdr) + (size_t)h->no_cmds * sizeof(script_cmd) + (size_t)h->no_args * sizeof(uint32_t) + h->str_size){
+		return FALSE;
+	}
+
+	script_cmd *cmds = (script_cmd*)(h + 1);
+	uint32_t *args = (uint32_t*)(cmds + h->no_cmds);
+	char *strs = (char*)(args + h->no_args);
+
+	if(h->str_size == 0 || strs[h->str_size - 1] != '\0'){
+		return FALSE;
+	}
+	for(uint32_t i = 0; i < h->no_cmds; i++){
+		if(cmds[i].argc == 0 || cmds[i].arg > h->no_args || cmds[i].argc > h->no_args - cmds[i].arg ||
+				cmds[i].path >= h->str_size || cmds[i].builtin < -1 || cmds[i].builtin >= NO_BUILTINS){
+			return FALSE;
+		}
+	}
+	for(uint32_t i = 0; i < h->no_args; i++){
+		if(args[i] >= h->str_size){
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+
+/*
+ * Function: script_compile
+ * --------------------
+ *  Compiles a script into commands with their arguments split and builtins and
+ *  executables resolved. Lines are split like input lines, '#' starts a comment.
+ *
+ *  *data: Script contents, changed while splitting
+ *  len: Length of data
+ *  *h: Header with the script's identity, the counts are filled in
+ *  *size: Where to store the size of the compiled script
+ *
+ *  returns: Compiled script, allocated with mysh_malloc. NULL if out of memory.
+ */
+static script_hdr *script_compile(char *data, size_t len, script_hdr *h, size_t *size){
+
+	char *cmds = NULL, *args = NULL, *strs = NULL;
+	size_t cmds_len = 0, cmds_size = 0, args_len = 0, args_size = 0, strs_len = 0, strs_size = 0;
+	char *line = data;
+	int ok = (buf_add(&strs, &strs_len, &strs_size, "", 1) != -1);
+
+	h->no_cmds = 0;
+	h->no_args = 0;
+	data[len] = '\0';
+
+	while(ok && line != NULL){
+		char *next = strchr(line, '\n');
+		if(next != NULL){
+			*next++ = '\0';
+		}
+
+		/* Comments */
+		for(char *c = strchr(line, '#'); c != NULL; c = strchr(c + 1, '#')){
+			if(c == line || c[-1] == ' ' || c[-1] == '\t'){
+				*c = '\0';
+				break;
+			}
+		}
+
+		script_cmd cmd;
+		char *state;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.arg = h->no_args;
+
+		/* Expansions change between runs: kept as the whole line */
+		if(subst_needed(line)){
+			long off = buf_add(&strs, &strs_len, &strs_size, line, strlen(line) + 1);
+			uint32_t arg = off;
+			ok = ok && (off != -1 && buf_add(&args, &args_len, &args_size, &arg, sizeof(arg)) != -1);
+			cmd.builtin = -1;
+			cmd.flags = SCRIPT_SUBST;
+			cmd.argc = 1;
+			h->no_args++;
+			ok = ok && (buf_add(&cmds, &cmds_len, &cmds_size, &cmd, sizeof(cmd)) != -1);
+			h->no_cmds++;
+			line = next;
+			continue;
+		}
+
+		for(char *token = strtok_r(line, ARGS_DELIM, &state); ok && token; token = strtok_r(NULL, ARGS_DELIM, &state)){
+			long off = buf_add(&strs, &strs_len, &strs_size, token, strlen(token) + 1);
+			uint32_t arg = off;
+			ok = (off != -1 && buf_add(&args, &args_len, &args_size, &arg, sizeof(arg)) != -1);
+			if(strpbrk(token, "*?[") != NULL){
+				cmd.flags |= SCRIPT_GLOB;
+			}
+			cmd.argc++;
+			h->no_args++;
+		}
+
+		/* Resolve what the first word runs */
+		if(ok && cmd.argc){
+			char *name = strs + ((uint32_t*)args)[cmd.arg];
+			char path[PATH_BUFSIZE];
+			cmd.builtin = builtin_index(name);
+			if(cmd.builtin == -1 && strchr(name, '/') == NULL && resolve_command(name, path) == 0){
+				long off = buf_add(&strs, &strs_len, &strs_size, path, strlen(path) + 1);
+				ok = (off != -1);
+				cmd.path = off;
+			}
+			ok = ok && (buf_add(&cmds, &cmds_len, &cmds_size, &cmd, sizeof(cmd)) != -1);
+			h->no_cmds++;
+		}
+
+		line = next;
+	}
+
+	h->str_size = strs_len;
+	*size = sizeof(script_hdr) + cmds_len + args_len + strs_len;
+
+	script_hdr *out = ok ? mysh_malloc(*size) : NULL;
+	if(out != NULL){
+		char *p = (char*)(out + 1);
+		*out = *h;
+		memcpy(p, cmds, cmds_len);
+		memcpy(p + cmds_len, args, args_len);
+		memcpy(p + cmds_len + args_len, strs, strs_len);
+	}
+	free(cmds);
+	free(args);
+	free(strs);
+	return out;
+}
+
+
+/*
+ * Function: script_save
+ * --------------------
+ *  Writes a compiled script to the cache, to a temporary file that is renamed, so
+ *  concurrent runs never load a partial file.
+ *
+ *  *cache: Cache file
+ *  *h: Compiled script
+ *  size: Size of the compiled script
+ */
+static void script_save(const char *cache, script_hdr *h, size_t size){
+
+	char tmp[PATH_BUFSIZE + 32];
+	snprintf(tmp, sizeof(tmp), "%s.%d", cache, getpid());
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd == -1){
+		return;
+	}
+	ssize_t w = write(fd, h, size);
+	if(close(fd) == -1 || w != (ssize_t)size || rename(tmp, cache) == -1){
+		unlink(tmp);
+	}
+}
+
+
+/*
+ * Function: script_load
+ * --------------------
+ *  Maps a compiled script from the cache. Mapped private and writable, since builtins
+ *  may change their arguments.
+ *
+ *  *cache: Cache file
+ *  *size: Where to store the size of the mapping
+ *
+ *  returns: Compiled script, NULL if missing or unusable.
+ */
+static script_hdr *script_load(const char *cache, size_t *size){
+
+	int fd = open(cache, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd == -1){
+		return NULL;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size < sizeof(script_hdr)){
+		close(fd);
+		return NULL;
+	}
+
+	script_hdr *h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(h == MAP_FAILED){
+		return NULL;
+	}
+	if(!script_check(h, st.st_size)){
+		munmap(h, st.st_size);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return h;
+}
+
+
+/*
+ * Function: script_exec
+ * --------------------
+ *  Runs the commands of a compiled script. Only globs, variables and substitutions are
+ *  expanded at run time, since the files they match and the values change between runs.
+ *
+ *  *h: Compiled script
+ *
+ *  returns: 0 when all commands were run, -1 on quit or signal.
+ */
+static int script_exec(script_hdr *h){
+
+	script_cmd *cmds = (script_cmd*)(h + 1);
+	uint32_t *args = (uint32_t*)(cmds + h->no_cmds);
+	char *strs = (char*)(args + h->no_args);
+
+	for(uint32_t i = 0; i < h->no_cmds && !m->signal_flag; i++){
+		script_cmd *cmd = &cmds[i];
+
+		/* Release memory of the previous command */
+		arena_reset(&m->arena);
+		m->glob_first = -1;
+		m->glob_last = -1;
+
+		/* Split when run, then resolved like an interactive command */
+		if(cmd->flags & SCRIPT_SUBST){
+			char **param;
+			char *line = arena_strndup(&m->arena, strs + args[cmd->arg], strlen(strs + args[cmd->arg]));
+			int no_params = line ? subst_split(line, &param) : -1;
+			if(no_params > 0){
+				no_params = glob_expand(&param, no_params);
+			}
+			if(no_params == -1){
+				fprintf(stderr, "ERROR: Failed to allocate memory\n");
+				continue;
+			}
+			if(param[0] && run_command(param, no_params, builtin_index(param[0]), NULL) == -1){
+				return -1;
+			}
+			stats_flush(FALSE);
+			continue;
+		}
+
+		char **param = arena_alloc(&m->arena, (cmd->argc + 1) * sizeof(char*));
+		int no_params = cmd->argc;
+		if(param == NULL){
+			fprintf(stderr, "ERROR: Failed to allocate memory\n");
+			return -1;
+		}
+		for(uint32_t j = 0; j < cmd->argc; j++){
+			param[j] = strs + args[cmd->arg + j];
+		}
+		param[no_params] = NULL;
+
+		if(cmd->flags & SCRIPT_GLOB){
+			no_params = glob_expand(&param, no_params);
+			if(no_params == -1){
+				fprintf(stderr, "ERROR: Failed to allocate memory\n");
+				continue;
+			}
+		}
+
+		if(run_command(param, no_params, cmd->builtin, cmd->path ? strs + cmd->path : NULL) == -1){
+			return -1;
+		}
+		stats_flush(FALSE);
+	}
+	return 0;
+}
+
+
+/*
+ * Function: script_run
+ * --------------------
+ *  Runs a script file. The compiled script is cached, keyed by the script's path, and
+ *  reused while the script's device, inode, size and mtime and PATH are unchanged. If
+ *  only the mtime changed, the contents hash decides. On a cache hit the script is
+ *  neither read nor split, the compiled script is mapped and run. The shell waits for
+ *  background jobs of the script before returning.
+ *
+ *  *path: Script
+ *
+ *  returns: Exit status of the last foreground command, 127 if the script can't be read.
+ */
+int script_run(const char *path){
+
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1 || fstat(fd, &st) == -1){
+		fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+		return 127;
+	}
+
+	char cache[PATH_BUFSIZE];
+	char *env = getenv("PATH");
+	int cached = (cache_path(path, cache) == 0);
+	size_t size = 0;
+	script_hdr id;
+
+	memset(&id, 0, sizeof(id));
+	id.magic = SCRIPT_MAGIC;
+	id.version = SCRIPT_VERSION;
+	id.dev = st.st_dev;
+	id.ino = st.st_ino;
+	id.size = st.st_size;
+	id.mtime_sec = st.st_mtim.tv_sec;
+	id.mtime_nsec = st.st_mtim.tv_nsec;
+	id.path_hash = hash64(env ? env : "", env ? strlen(env) : 0);
+
+	script_hdr *h = cached ? script_load(cache, &size) : NULL;
+	int mapped = (h != NULL);
+	int hit = mapped && h->dev == id.dev && h->ino == id.ino && h->size == id.size &&
+		h->mtime_sec == id.mtime_sec && h->mtime_nsec == id.mtime_nsec && h->path_hash == id.path_hash;
+
+	if(!hit){
+		char *data = mysh_malloc(st.st_size + 1);
+		ssize_t n = data ? read(fd, data, st.st_size) : -1;
+		if(n != st.st_size){
+			fprintf(stderr, "mysh: %s: could not read script\n", path);
+			free(data);
+			close(fd);
+			return 127;
+		}
+		id.hash = hash64(data, n);
+
+		/* Touched but not changed: only the identity is updated */
+		if(mapped && h->hash == id.hash && h->path_hash == id.path_hash){
+			memcpy(h, &id, offsetof(script_hdr, no_cmds));
+			script_save(cache, h, size);
+		}
+		else{
+			if(mapped){
+				munmap(h, size);
+				mapped = FALSE;
+			}
+			h = script_compile(data, n, &id, &size);
+			if(h != NULL && cached){
+				script_save(cache, h, size);
+			}
+		}
+		free(data);
+	}
+	close(fd);
+
+	if(h == NULL){
+		fprintf(stderr, "ERROR: Failed to allocate memory\n");
+		return 127;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: Script %s: %s, %u commands, %zu bytes\n", path,
+			hit ? "cached" : "compiled", h->no_cmds, size);
+#endif
+
+	script_exec(h);
+
+	if(mapped){
+		munmap(h, size);
+	}
+	else{
+		free(h);
+	}
+
+	/* Wait for background and queued jobs */
+	while((m->no_jobs || m->no_queued) && !m->signal_flag){
+		ev_poll(-1, admit_timeout());
+	}
+
+	return WIFEXITED(m->fg_status) ? WEXITSTATUS(m->fg_status) : 128 + WTERMSIG(m->fg_status);
+}
@@ -0,0 +1,165 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+
+/*
+ * Function: shist_open
+ * --------------------
+ *  Maps the shared history segment, creating it if this is the first session using it.
+ *  A new segment is all zero, which is a valid empty history.
+ *
+ *  *name: Name of the POSIX shared memory object, e.g "/mysh-history"
+ *
+ *  returns: 0 on success, -1 on error.
+ */
+int shist_open(const char *name){
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd == -1){
+		perror("mysh: shared history");
+		return -1;
+	}
+
+	/* Every session sets the same size, so racing creators agree */
+	struct stat st;
+	if(fstat(fd, &st) == -1 || (st.st_size < sizeof(shist) && ftruncate(fd, sizeof(shist)) == -1)){
+		perror("mysh: shared history");
+		close(fd);
+		return -1;
+	}
+
+	shist *sh = mmap(NULL, sizeof(shist), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(sh == MAP_FAILED){
+		perror("mysh: shared history");
+		return -1;
+	}
+
+	/* Claim a new segment, or check that it has our layout */
+	uint32_t magic = 0;
+	__atomic_compare_exchange_n(&sh->magic, &magic, SHIST_MAGIC, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if(magic != 0 && magic != SHIST_MAGIC){
+		fprintf(stderr, "mysh: shared history: %s is not a mysh history segment\n", name);
+		munmap(sh, sizeof(shist));
+		return -1;
+	}
+
+	m->shist = sh;
+	return 0;
+}
+
+
+/*
+ * Function: shist_close
+ * --------------------
+ *  Unmaps the shared history segment. The segment is kept for other sessions.
+ */
+void shist_close(){
+
+	if(m->shist != NULL){
+		munmap(m->shist, sizeof(shist));
+		m->shist = NULL;
+	}
+}
+
+
+/*
+ * Function: shist_append
+ * --------------------
+ *  Appends a command to the shared history. The slot is reserved with an atomic
+ *  increment, then published by storing its sequence number last.
+ *
+ *  *line: Command
+ *  len: Length of the command
+ */
+void shist_append(const char *line, size_t len){
+
+	shist *sh = m->shist;
+	if(sh == NULL){
+		return;
+	}
+
+	uint64_t seq = __atomic_fetch_add(&sh->next, 1, __ATOMIC_RELAXED);
+	shist_entry *e = &sh->entries[seq % SHIST_SLOTS];
+
+	/* Readers skip the slot while it is written */
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if(len >= sizeof(e->cmd)){
+		len = sizeof(e->cmd) - 1;
+	}
+	e->session = getpid();
+	e->time = time(NULL);
+	e->len = len;
+	memcpy(e->cmd, line, len);
+	e->cmd[len] = '\0';
+
+	__atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Function: shist_read
+ * --------------------
+ *  Copies a command out of the shared history without locking. The copy is only valid
+ *  if the slot still holds the same command after copying.
+ *
+ *  seq: Sequence number of the command
+ *  *out: Where to store the command
+ *
+ *  returns: 0 on success, -1 if the slot was overwritten or is being written.
+ */
+int shist_read(uint64_t seq, shist_entry *out){
+
+	shist_entry *e = &m->shist->entries[seq % SHIST_SLOTS];
+
+	uint64_t before = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+	if(before != seq + 1){
+		return -1;
+	}
+
+	out->session = e->session;
+	out->time = e->time;
+	out->len = e->len;
+	memcpy(out->cmd, e->cmd, sizeof(out->cmd));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != before){
+		return -1;
+	}
+
+	out->cmd[sizeof(out->cmd) - 1] = '\0';
+	out->seq = before;
+	return 0;
+}
+
+
+/*
+ * Function: shist_print
+ * --------------------
+ *  Prints the shared history of all sessions, oldest first, with session id and time.
+ *
+ *  session: Only print commands from this session (pid), 0 for all.
+ */
+void shist_print(pid_t session){
+
+	shist *sh = m->shist;
+	uint64_t next = __atomic_load_n(&sh->next, __ATOMIC_ACQUIRE);
+	uint64_t first = next > SHIST_SLOTS ? next - SHIST_SLOTS : 0;
+
+	printf("\nShared history of %s:\n", session ? "session" : "all sessions");
+	for(uint64_t seq = first; seq < next; seq++){
+		shist_entry e;
+		if(shist_read(seq, &e) == -1 || (session && e.session != session)){
+			continue;
+		}
+		char stamp[32];
+		time_t t = e.time;
+		struct tm tm;
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+		printf("%5lu: [%d %s] %s\n", (unsigned long)seq + 1, e.session, stamp, e.cmd);
+	}
+}
@@ -0,0 +1,382 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* Phase names, indexed by STAT_* */
+static char *phases[] = { "parse", "launch", "run", "wait" };
+
+
+/*
+ * Function: stats_now
+ * --------------------
+ *  Monotonic time in nanoseconds, only read when stats are on.
+ *
+ *  returns: Time in ns, 0 when stats are off.
+ */
+uint64_t stats_now(){
+
+	if(!m->stats_on){
+		return 0;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+ * Function: stats_bucket
+ * --------------------
+ *  Log-linear bucket of a value: STATS_SUB buckets per power of two, so every bucket
+ *  is within 1/STATS_SUB of the values in it.
+ *
+ *  ns: Value
+ *
+ *  returns: Bucket index.
+ */
+static int stats_bucket(uint64_t ns){
+
+	if(ns < STATS_SUB){
+		return ns;
+	}
+	int shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+	int b = (shift + 1) * STATS_SUB + ((ns >> shift) & (STATS_SUB - 1));
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+
+/*
+ * Function: stats_value
+ * --------------------
+ *  Middle of the range of values in a bucket.
+ *
+ *  b: Bucket index
+ *
+ *  returns: Value in ns.
+ */
+static uint64_t stats_value(int b){
+
+	if(b < STATS_SUB){
+		return b;
+	}
+	int shift = b / STATS_SUB - 1;
+	uint64_t low = (uint64_t)(STATS_SUB + b % STATS_SUB) << shift;
+	return low + ((1ull << shift) >> 1);
+}
+
+
+/*
+ * Function: stats_find
+ * --------------------
+ *  Finds the stats of a command, adding it if new. Open addressing on the name hash.
+ *
+ *  *cmd: Command name
+ *
+ *  returns: Stats of the command, NULL if the table is full.
+ */
+cmd_stats *stats_find(const char *cmd){
+
+	size_t len = strlen(cmd);
+	if(len >= STATS_NAME){
+		len = STATS_NAME - 1;
+	}
+	uint32_t i = hist_hash(cmd, len) & (STATS_MAX - 1);
+
+	while(m->stats[i] != NULL){
+		if(strncmp(m->stats[i]->name, cmd, len) == 0 && m->stats[i]->name[len] == '\0'){
+			return m->stats[i];
+		}
+		i = (i + 1) & (STATS_MAX - 1);
+	}
+
+	/* Keep the table sparse for short probes */
+	if(m->no_stats >= STATS_MAX * 3 / 4){
+		return NULL;
+	}
+
+	cmd_stats *s = pool_alloc(&m->stats_pool);
+	if(s == NULL){
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+	memcpy(s->name, cmd, len);
+	m->stats[i] = s;
+	m->no_stats++;
+	return s;
+}
+
+
+/*
+ * Function: stats_record
+ * --------------------
+ *  Records a latency sample of a command phase.
+ *
+ *  *cmd: Command name
+ *  phase: STAT_PARSE, STAT_LAUNCH, STAT_RUN or STAT_WAIT
+ *  ns: Latency in nanoseconds
+ */
+void stats_record(const char *cmd, int phase, uint64_t ns){
+
+	if(!m->stats_on || cmd == NULL){
+		return;
+	}
+
+	cmd_stats *s = stats_find(cmd);
+	if(s == NULL){
+		return;
+	}
+
+	s->hist[phase][stats_bucket(ns)]++;
+	s->count[phase]++;
+	s->sum[phase] += ns;
+	if(ns > s->max[phase]){
+		s->max[phase] = ns;
+	}
+}
+
+
+/*
+ * Function: stats_percentile
+ * --------------------
+ *  Value at a percentile of a phase histogram.
+ *
+ *  *s: Command stats
+ *  phase: Phase
+ *  q: Percentile, 0-1
+ *
+ *  returns: Value in ns, the max for the last bucket.
+ */
+uint64_t stats_percentile(cmd_stats *s, int phase, double q){
+
+	uint64_t rank = (uint64_t)(q * s->count[phase] + 0.999999);
+	uint64_t seen = 0;
+
+	if(rank == 0){
+		rank = 1;
+	}
+	for(int b = 0; b < STATS_BUCKETS; b++){
+		seen += s->hist[phase][b];
+		if(seen >= rank){
+			uint64_t v = stats_value(b);
+			return v < s->max[phase] ? v : s->max[phase];
+		}
+	}
+	return s->max[phase];
+}
+
+
+/*
+ * Function: format_ns
+ * --------------------
+ *  Formats a duration with a unit that keeps it short.
+ *
+ *  ns: Duration
+ *  *buf: Buffer to write to
+ *  len: Size of buf
+ */
+static void format_ns(uint64_t ns, char *buf, size_t len){
+
+	if(ns < 10000){
+		snprintf(buf, len, "%luns", (unsigned long)ns);
+	}
+	else if(ns < 10000000){
+		snprintf(buf, len, "%.1fus", ns / 1e3);
+	}
+	else if(ns < 10000000000ull){
+		snprintf(buf, len, "%.1fms", ns / 1e6);
+	}
+	else{
+		snprintf(buf, len, "%.1fs", ns / 1e9);
+	}
+}
+
+
+/*
+ * Function: stats_print
+ * --------------------
+ *  Prints p50/p90/p99/max of each command and phase.
+ */
+void stats_print(){
+
+	double q[] = { 0.5, 0.9, 0.99 };
+
+	printf("%-16s %-7s %8s %9s %9s %9s %9s\n", "Command", "Phase", "Count", "p50", "p90", "p99", "max");
+	for(int i = 0; i < STATS_MAX; i++){
+		cmd_stats *s = m->stats[i];
+		if(s == NULL){
+			continue;
+		}
+		for(int p = 0; p < STAT_PHASES; p++){
+			if(!s->count[p]){
+				continue;
+			}
+			char v[4][16];
+			for(int j = 0; j < 3; j++){
+				format_ns(stats_percentile(s, p, q[j]), v[j], sizeof(v[j]));
+			}
+			format_ns(s->max[p], v[3], sizeof(v[3]));
+			printf("%-16s %-7s %8lu %9s %9s %9s %9s\n", s->name, phases[p], (unsigned long)s->count[p], v[0], v[1], v[2], v[3]);
+		}
+	}
+}
+
+
+/*
+ * Function: write_escaped
+ * --------------------
+ *  Writes a command name as the inside of a quoted JSON string or Prometheus label value.
+ */
+static void write_escaped(FILE *f, const char *str){
+
+	for(; *str; str++){
+		if(*str == '"' || *str == '\\'){
+			fprintf(f, "\\%c", *str);
+		}
+		else if(*str == '\n'){
+			fprintf(f, "\\n");
+		}
+		else if((unsigned char)*str < 0x20){
+			fprintf(f, "\\u%04x", *str);
+		}
+		else{
+			fputc(*str, f);
+		}
+	}
+}
+
+
+/*
+ * Function: stats_write
+ * --------------------
+ *  Writes all stats to a file, as JSON if the name ends in .json and as a Prometheus
+ *  textfile otherwise. Written to a temporary file and renamed, so readers never see
+ *  a partial file.
+ *
+ *  *path: File to write
+ *
+ *  returns: 0 on success, -1 on error.
+ */
+int stats_write(const char *path){
+
+	double q[] = { 0.5, 0.9, 0.99 };
+	char *qname[] = { "0.5", "0.9", "0.99" };
+	char *jname[] = { "p50", "p90", "p99" };
+	char tmp[PATH_BUFSIZE + 8];
+	size_t len = strlen(path);
+	int json = (len > 5 && strcmp(path + len - 5, ".json") == 0);
+	int first = TRUE;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if(f == NULL){
+		perror("mysh: stats");
+		return -1;
+	}
+
+	if(json){
+		fprintf(f, "{\"commands\":[");
+	}
+	else{
+		fprintf(f, "# HELP mysh_command_latency_seconds Latency of shell commands by phase.\n");
+		fprintf(f, "# TYPE mysh_command_latency_seconds summary\n");
+	}
+
+	for(int i = 0; i < STATS_MAX; i++){
+		cmd_stats *s = m->stats[i];
+		if(s == NULL){
+			continue;
+		}
+		if(json){
+			fprintf(f, "%s{\"command\":\"", first ? "" : ",");
+			write_escaped(f, s->name);
+			fprintf(f, "\",\"phases\":{");
+			first = FALSE;
+		}
+		int first_phase = TRUE;
+		for(int p = 0; p < STAT_PHASES; p++){
+			if(!s->count[p]){
+				continue;
+			}
+			if(json){
+				fprintf(f, "%s\"%s\":{\"count\":%lu,\"sum_ns\":%lu", first_phase ? "" : ",", phases[p],
+						(unsigned long)s->count[p], (unsigned long)s->sum[p]);
+				for(int j = 0; j < 3; j++){
+					fprintf(f, ",\"%s_ns\":%lu", jname[j], (unsigned long)stats_percentile(s, p, q[j]));
+				}
+				fprintf(f, ",\"max_ns\":%lu}", (unsigned long)s->max[p]);
+				first_phase = FALSE;
+				continue;
+			}
+			for(int j = 0; j < 4; j++){
+				fprintf(f, "mysh_command_latency_seconds{command=\"");
+				write_escaped(f, s->name);
+				if(j < 3){
+					fprintf(f, "\",phase=\"%s\",quantile=\"%s\"} %.9f\n", phases[p], qname[j], stats_percentile(s, p, q[j]) / 1e9);
+				}
+				else{
+					fprintf(f, "\",phase=\"%s\",quantile=\"1\"} %.9f\n", phases[p], s->max[p] / 1e9);
+				}
+			}
+			fprintf(f, "mysh_command_latency_seconds_sum{command=\"");
+			write_escaped(f, s->name);
+			fprintf(f, "\",phase=\"%s\"} %.9f\n", phases[p], s->sum[p] / 1e9);
+			fprintf(f, "mysh_command_latency_seconds_count{command=\"");
+			write_escaped(f, s->name);
+			fprintf(f, "\",phase=\"%s\"} %lu\n", phases[p], (unsigned long)s->count[p]);
+		}
+		if(json){
+			fprintf(f, "}}");
+		}
+	}
+
+	if(json){
+		fprintf(f, "]}\n");
+	}
+
+	if(fclose(f) == EOF || rename(tmp, path) == -1){
+		perror("mysh: stats");
+		unlink(tmp);
+		return -1;
+	}
+
+	m->stats_written = time(NULL);
+	return 0;
+}
+
+
+/*
+ * Function: stats_flush
+ * --------------------
+ *  Writes stats to $MYSH_STATS_FILE if set and STATS_FLUSH_SEC has passed since the
+ *  last write. Called after each command and, with force, at exit.
+ *
+ *  force: Write even if the interval has not passed
+ */
+void stats_flush(int force){
+
+	if(m->stats_file == NULL || !m->no_stats){
+		return;
+	}
+	if(force || time(NULL) - m->stats_written >= STATS_FLUSH_SEC){
+		stats_write(m->stats_file);
+	}
+}
+
+
+/*
+ * Function: stats_reset
+ * --------------------
+ *  Removes all recorded stats.
+ */
+void stats_reset(){
+
+	for(int i = 0; i < STATS_MAX; i++){
+		if(m->stats[i] != NULL){
+			pool_free(&m->stats_pool, m->stats[i]);
+			m->stats[i] = NULL;
+		}
+	}
+	m->no_stats = 0;
+}
@@ -0,0 +1,483 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+
+/*
+ * Function: subst_needed
+ * --------------------
+ *  Checks if a line may need expansion when split: command substitution, variables or
+ *  arithmetic, i.e it has '$' or '`'.
+ *
+ *  *str: Line
+ *
+ *  returns: 1 if it has, 0 if not.
+ */
+int subst_needed(const char *str){
+	return strpbrk(str, "$`") != NULL;
+}
+
+
+/*
+ * Function: subst_end
+ * --------------------
+ *  Finds the end of a substitution: the ')' matching '$(', counting nested parentheses,
+ *  or the next '`'.
+ *
+ *  *str: Start of the command, after '$(' or '`'
+ *  close: ')' or '`'
+ *
+ *  returns: Pointer to the end, NULL if there is none.
+ */
+static char *subst_end(char *str, char close){
+
+	if(close == '`'){
+		return strchr(str, '`');
+	}
+
+	int depth = 0;
+	for(char *c = str; *c; c++){
+		if(*c == '('){
+			depth++;
+		}
+		else if(*c == ')' && depth-- == 0){
+			return c;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Function: subst_run
+ * --------------------
+ *  Runs a command with its stdout in a file. A builtin runs in the shell process with the
+ *  shell's stdout pointed at the file only while it runs, background output and admission
+ *  of queued jobs are held off from the capture meanwhile (term_fd). Other commands run in
+ *  a child with the file as stdout, a subshell with its own event pipe and none of the
+ *  shell's jobs or timers, while the shell waits and keeps writing job output to its own
+ *  stdout.
+ *
+ *  **param: Command and arguments
+ *  no_params: Number of parameters in param
+ *  fd: File for the output
+ */
+static void subst_run(char **param, int no_params, int fd){
+
+	int builtin = builtin_index(param[0]);
+	fflush(stdout);
+
+	if(builtin != -1){
+		int saved = dup(STDOUT_FILENO);
+		if(saved == -1 || dup2(fd, STDOUT_FILENO) == -1){
+			perror("mysh: $()");
+			if(saved != -1){
+				close(saved);
+			}
+			return;
+		}
+		int term_fd = m->term_fd;
+		if(term_fd == -1){
+			m->term_fd = saved;
+		}
+		run_command(param, no_params, builtin, NULL);
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+		m->term_fd = term_fd;
+		admit_jobs();
+		return;
+	}
+
+	pid_t pid = fork();
+	if(pid == 0){
+		/* The jobs, their output and timers, the queue and child events stay with the shell */
+		dup2(fd, STDOUT_FILENO);
+		for(int i = 0; i < m->no_jobs; i++){
+			if(m->jobs[i]->out_fd != -1){
+				close(m->jobs[i]->out_fd);
+			}
+			deadline_clear(&m->jobs[i]->timer);
+		}
+		m->no_jobs = 0;
+		m->no_queued = 0;
+		m->term_fd = -1;
+		deadline_clear(&m->fg_deadline);
+		deadline_init(&m->fg_deadline);
+		close(m->ev_fd[0]);
+		close(m->ev_fd[1]);
+		ev_init();
+		run_command(param, no_params, builtin, NULL);
+		fflush(stdout);
+		int status = m->fg_status;
+		_exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+	}
+	else if(pid < 0){
+		fprintf(stderr, "ERROR: Unable to fork");
+		return;
+	}
+	wait_fg(pid);
+}
+
+
+/*
+ * Function: subst_capture
+ * --------------------
+ *  Runs a command with its output captured in a memfd (subst_run). Up to SUBST_READ
+ *  bytes of output are read into the arena, more is mapped from the memfd until the
+ *  arena is reset.
+ *
+ *  *cmd: Command line, split in place
+ *  *len: Where to store the length of the output
+ *
+ *  returns: NUL terminated writable output, NULL on error.
+ */
+static char *subst_capture(char *cmd, size_t *len){
+
+	int fd = memfd_create("mysh-subst", MFD_CLOEXEC);
+	if(fd == -1){
+		perror("mysh: $()");
+		return NULL;
+	}
+
+	char **param;
+	int no_params = subst_split(cmd, &param);
+	if(no_params > 0){
+		no_params = glob_expand(&param, no_params);
+	}
+	if(no_params == -1){
+		close(fd);
+		return NULL;
+	}
+	if(param[0]){
+		subst_run(param, no_params, fd);
+	}
+
+	struct stat st;
+	char *out = NULL;
+	if(fstat(fd, &st) == 0){
+		*len = st.st_size;
+		if(*len <= SUBST_READ){
+			out = arena_alloc(&m->arena, *len + 1);
+			if(out != NULL && pread(fd, out, *len, 0) != (ssize_t)*len){
+				out = NULL;
+			}
+		}
+		/* One more byte for the NUL, mapped from the zero filled end of the memfd */
+		else if(ftruncate(fd, *len + 1) == 0){
+			out = arena_map(&m->arena, fd, *len + 1);
+		}
+	}
+	if(out != NULL){
+		out[*len] = '\0';
+	}
+	else{
+		perror("mysh: $()");
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: Substitution: %zu bytes %s\n", out ? *len : 0, out && *len > SUBST_READ ? "mapped" : "read");
+#endif
+
+	close(fd);
+	return out;
+}
+
+
+/*
+ * Function: add_token
+ * --------------------
+ *  Appends a token to a token array in the arena, growing it when full.
+ *
+ *  ***tokens: Token array
+ *  *pos: Number of tokens
+ *  *cap: Size of the array
+ *  *token: Token
+ *
+ *  returns: 0 on success, -1 if out of memory.
+ */
+static int add_token(char ***tokens, int *pos, int *cap, char *token){
+
+	if(*pos + 1 >= *cap){
+		char **grown = arena_alloc(&m->arena, 2 * *cap * sizeof(char*));
+		if(grown == NULL){
+			return -1;
+		}
+		memcpy(grown, *tokens, *pos * sizeof(char*));
+		*tokens = grown;
+		*cap *= 2;
+	}
+	(*tokens)[(*pos)++] = token;
+	return 0;
+}
+
+
+/*
+ * Function: join
+ * --------------------
+ *  Concatenates the word being built with more of it, in the arena.
+ *
+ *  *word: Word so far, NULL if none
+ *  *str: String to add
+ *  len: Length of str
+ *
+ *  returns: The new word, NULL if out of memory.
+ */
+static char *join(char *word, const char *str, size_t len){
+
+	size_t word_len = word ? strlen(word) : 0;
+	char *ret = arena_alloc(&m->arena, word_len + len + 1);
+	if(ret != NULL){
+		memcpy(ret, word, word_len);
+		memcpy(ret + word_len, str, len);
+		ret[word_len + len] = '\0';
+	}
+	return ret;
+}
+
+
+/*
+ * Function: subst_value
+ * --------------------
+ *  Value of a variable or arithmetic expansion at '$': '$((expr))', '${NAME}', '$NAME'
+ *  or '$?' (exit status of the last foreground command). Variables are not copied.
+ *
+ *  *p: The '$'
+ *  **end: Where to store the first character after the expansion
+ *  **value: Where to store the value, NULL if the variable is not set
+ *
+ *  returns: 1 if there is an expansion, 0 if the '$' is literal, -1 on error.
+ */
+static int subst_value(char *p, char **end, const char **value){
+
+	size_t len;
+	*value = NULL;
+
+	/* Arithmetic, ends at the ')' closing '$(' */
+	if(p[1] == '(' && p[2] == '('){
+		char *close = subst_end(p + 2, ')');
+		int64_t n;
+		if(close == NULL || close[-1] != ')' || close - 1 < p + 3){
+			fprintf(stderr, "mysh: unmatched $((\n");
+			return -1;
+		}
+		close[-1] = '\0';
+		if(arith_eval(p + 3, &n) == -1){
+			return -1;
+		}
+		char *num = arena_alloc(&m->arena, 24);
+		if(num == NULL){
+			return -1;
+		}
+		snprintf(num, 24, "%lld", (long long)n);
+		*value = num;
+		*end = close + 1;
+		return TRUE;
+	}
+
+	if(p[1] == '?'){
+		char *num = arena_alloc(&m->arena, 16);
+		if(num == NULL){
+			return -1;
+		}
+		int status = m->fg_status;
+		snprintf(num, 16, "%d", WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+		*value = num;
+		*end = p + 2;
+		return TRUE;
+	}
+
+	if(p[1] == '{'){
+		len = var_name_len(p + 2);
+		if(len == 0 || p[2 + len] != '}'){
+			fprintf(stderr, "mysh: %.*s: bad substitution\n", (int)strcspn(p, ARGS_DELIM), p);
+			return -1;
+		}
+		*value = var_get(p + 2, len);
+		*end = p + 3 + len;
+		return TRUE;
+	}
+
+	len = var_name_len(p + 1);
+	if(len == 0){
+		return FALSE;
+	}
+	*value = var_get(p + 1, len);
+	*end = p + 1 + len;
+	return TRUE;
+}
+
+
+/*
+ * Function: subst_split
+ * --------------------
+ *  Splits a line into words like strtok_param, expanding as it goes. '$(cmd)' and '`cmd`'
+ *  are replaced with the output of cmd less trailing newlines, split into words at
+ *  ARGS_DELIM. Output words are tokens in the capture buffer itself; only the words
+ *  joined with text next to the substitution, as in 'v$(cat version).tar', are copied.
+ *  Substitutions can be nested with '$(...)'. Variables and '$((expr))' are expanded
+ *  within the word, a word that is just '$NAME' is the variable's value, not a copy,
+ *  unless the line starts with 'NAME=value': all words are expanded before the
+ *  assignments are made. Words that expand to nothing are dropped.
+ *
+ *  *str: Line to be split, changed in place
+ *  ***saveptr: Pointer to where the token array will be saved.
+ *
+ *  returns: Number of tokens, 0 if no tokens or on error, -1 if out of memory.
+ */
+int subst_split(char *str, char ***saveptr){
+
+	int pos = 0;
+	int cap = PARAMS_BUFSIZE;
+	char **tokens = arena_alloc(&m->arena, cap * sizeof(char*));
+	char *p = str;
+
+	if(tokens == NULL){
+		return -1;
+	}
+	tokens[0] = NULL;
+	*saveptr = tokens;
+
+	/* Leading assignments are made after the split, values they may change are copied */
+	p += strspn(p, ARGS_DELIM);
+	size_t name_len = var_name_len(p);
+	int copy = (name_len && p[name_len] == '=');
+
+	while(TRUE){
+		p += strspn(p, ARGS_DELIM);
+		if(*p == '\0'){
+			break;
+		}
+
+		/* Word being built, NULL while only literal text from lit is in it */
+		char *word = NULL;
+		int substituted = FALSE;
+		char *lit = p;
+
+		while(*p && strchr(ARGS_DELIM, *p) == NULL){
+			int dollar = (p[0] == '$' && p[1] == '(' && p[2] != '(');
+
+			/* Variables and arithmetic: one piece of the word, not split */
+			if(p[0] == '$' && !dollar){
+				const char *value;
+				char *end;
+				int r = subst_value(p, &end, &value);
+				if(r == -1){
+					tokens[0] = NULL;
+					return 0;
+				}
+				if(r == FALSE){
+					p++;
+					continue;
+				}
+				if(p > lit && (word = join(word, lit, p - lit)) == NULL){
+					return -1;
+				}
+				if(value != NULL && *value){
+					/* A word that is only the value points to it */
+					word = (word || copy) ? join(word, value, strlen(value)) : (char*)value;
+					if(word == NULL){
+						return -1;
+					}
+				}
+				substituted = TRUE;
+				p = end;
+				lit = p;
+				continue;
+			}
+			if(!dollar && p[0] != '`'){
+				p++;
+				continue;
+			}
+
+			char *cmd = p + 1 + dollar;
+			char *end = subst_end(cmd, dollar ? ')' : '`');
+			if(end == NULL){
+				fprintf(stderr, "mysh: unmatched %s\n", dollar ? "$(" : "`");
+				tokens[0] = NULL;
+				return 0;
+			}
+			*end = '\0';
+
+			/* Literal text before the substitution */
+			if(p > lit && (word = join(word, lit, p - lit)) == NULL){
+				return -1;
+			}
+			substituted = TRUE;
+
+			size_t len;
+			char *out = subst_capture(cmd, &len);
+			if(out == NULL){
+				tokens[0] = NULL;
+				return 0;
+			}
+			while(len > 0 && out[len - 1] == '\n'){
+				out[--len] = '\0';
+			}
+
+			/* Leading blanks end the word before, trailing blanks the last word */
+			int leading = (*out && strchr(ARGS_DELIM, *out) != NULL);
+			int trailing = (len > 0 && strchr(ARGS_DELIM, out[len - 1]) != NULL);
+			if(leading && word != NULL){
+				if(add_token(&tokens, &pos, &cap, word) == -1){
+					return -1;
+				}
+				word = NULL;
+			}
+
+			char *state;
+			int first = TRUE;
+			for(char *w = strtok_r(out, ARGS_DELIM, &state); w != NULL; w = strtok_r(NULL, ARGS_DELIM, &state)){
+				if(first && word != NULL){
+					if((word = join(word, w, strlen(w))) == NULL){
+						return -1;
+					}
+				}
+				else{
+					if(word != NULL && add_token(&tokens, &pos, &cap, word) == -1){
+						return -1;
+					}
+					word = w;
+				}
+				first = FALSE;
+			}
+
+			if(trailing && word != NULL){
+				if(add_token(&tokens, &pos, &cap, word) == -1){
+					return -1;
+				}
+				word = NULL;
+			}
+
+			p = end + 1;
+			lit = p;
+		}
+
+		/* End of the word: in place when it is only literal text */
+		if(!substituted){
+			word = lit;
+		}
+		else if(p > lit && (word = join(word, lit, p - lit)) == NULL){
+			return -1;
+		}
+		if(*p){
+			*p++ = '\0';
+		}
+		if(word != NULL && (*word || !substituted) && add_token(&tokens, &pos, &cap, word) == -1){
+			return -1;
+		}
+	}
+
+	tokens[pos] = NULL;
+	*saveptr = tokens;
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: Number of tokens after substitution: %d\n", pos);
+	for(int i = 0; tokens[i]; i++){
+		fprintf(stderr, "DEBUG: [%d]: %s\n", i, tokens[i]);
+	}
+#endif
+
+	return pos;
+}
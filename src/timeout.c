@@ -0,0 +1,339 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+/* Signals by name, for -s */
+static const struct { const char *name; int sig; } signals[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+	{ "CONT", SIGCONT }, { "STOP", SIGSTOP }
+};
+
+
+/*
+ * Function: parse_duration
+ * --------------------
+ *  Parses a duration as in timeout(1): a number, may be fractional, with an optional
+ *  unit s (default), m, h or d.
+ *
+ *  *str: Duration
+ *  *ns: Where to store the duration in nanoseconds
+ *
+ *  returns: 0 on success, -1 if not a duration.
+ */
+int parse_duration(const char *str, uint64_t *ns){
+
+	char *end;
+	double sec = strtod(str, &end);
+	if(end == str || sec < 0){
+		return -1;
+	}
+
+	switch(*end){
+		case 'd':
+			sec *= 24;
+			/* fall through */
+		case 'h':
+			sec *= 60;
+			/* fall through */
+		case 'm':
+			sec *= 60;
+			/* fall through */
+		case 's':
+			end++;
+			/* fall through */
+		case '\0':
+			break;
+		default:
+			return -1;
+	}
+	if(*end != '\0' || sec > 1e9){
+		return -1;
+	}
+	*ns = (uint64_t)(sec * 1e9);
+	return 0;
+}
+
+
+/*
+ * Function: parse_signal
+ * --------------------
+ *  Parses a signal given by number or name, with or without SIG.
+ *
+ *  *str: Signal
+ *
+ *  returns: Signal number, -1 if unknown.
+ */
+int parse_signal(const char *str){
+
+	char *end;
+	long sig = strtol(str, &end, 10);
+	if(end != str && *end == '\0'){
+		return (sig > 0 && sig < NSIG) ? sig : -1;
+	}
+
+	if(strncmp(str, "SIG", 3) == 0){
+		str += 3;
+	}
+	for(size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++){
+		if(strcmp(str, signals[i].name) == 0){
+			return signals[i].sig;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Function: deadline_set
+ * --------------------
+ *  Arms a timerfd to go off after a time.
+ *
+ *  *d: Deadline
+ *  ns: Nanoseconds from now
+ *
+ *  returns: 0 on success, -1 on error.
+ */
+static int deadline_set(deadline *d, uint64_t ns){
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000ull;
+	its.it_value.tv_nsec = ns % 1000000000ull;
+	if(ns == 0){
+		its.it_value.tv_nsec = 1;
+	}
+	return timerfd_settime(d->fd, 0, &its, NULL);
+}
+
+
+/*
+ * Function: deadline_init
+ * --------------------
+ *  Initializes a deadline that is not armed.
+ *
+ *  *d: Deadline
+ */
+void deadline_init(deadline *d){
+
+	d->fd = -1;
+	d->sig = SIGTERM;
+	d->grace = 0;
+	d->stage = 0;
+}
+
+
+/*
+ * Function: deadline_arm
+ * --------------------
+ *  Arms a deadline for a process group: when it goes off, sig is sent to the group, and
+ *  SIGKILL after grace if the group is still there.
+ *
+ *  *d: Deadline
+ *  ns: Nanoseconds until sig is sent
+ *  sig: Signal to send first
+ *  grace: Nanoseconds from sig until SIGKILL, 0 for no SIGKILL
+ *
+ *  returns: 0 on success, -1 on error.
+ */
+int deadline_arm(deadline *d, uint64_t ns, int sig, uint64_t grace){
+
+	d->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(d->fd == -1 || deadline_set(d, ns) == -1){
+		perror("mysh: timeout");
+		deadline_clear(d);
+		return -1;
+	}
+	d->sig = sig;
+	d->grace = grace;
+	d->stage = 0;
+	return 0;
+}
+
+
+/*
+ * Function: deadline_clear
+ * --------------------
+ *  Disarms a deadline. Whether it went off is kept in stage.
+ *
+ *  *d: Deadline
+ */
+void deadline_clear(deadline *d){
+
+	if(d->fd != -1){
+		close(d->fd);
+		d->fd = -1;
+	}
+}
+
+
+/*
+ * Function: deadline_expire
+ * --------------------
+ *  Handles a deadline that went off: the first time its signal is sent to the process
+ *  group and the grace period is armed, the second time the group is killed.
+ *
+ *  *d: Deadline
+ *  pgid: Process group
+ */
+static void deadline_expire(deadline *d, pid_t pgid){
+
+	uint64_t count;
+	if(read(d->fd, &count, sizeof(count)) != sizeof(count)){
+		return;
+	}
+	if(pgid <= 0){
+		deadline_clear(d);
+		return;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: Deadline of %d: stage %d\n", pgid, d->stage + 1);
+#endif
+
+	if(d->stage++ == 0){
+		kill(-pgid, d->sig);
+		if(d->sig == SIGSTOP){
+			kill(-pgid, SIGCONT);
+		}
+		if(d->grace && d->sig != SIGKILL && deadline_set(d, d->grace) == 0){
+			return;
+		}
+	}
+	else{
+		kill(-pgid, SIGKILL);
+	}
+	deadline_clear(d);
+}
+
+
+/*
+ * Function: deadline_pollfds
+ * --------------------
+ *  Adds the armed deadlines of the foreground command and of background jobs to a poll set.
+ *
+ *  *fds: Poll set with room for MAX_JOBS + 1 more
+ *
+ *  returns: Number of timers added.
+ */
+int deadline_pollfds(struct pollfd *fds){
+
+	int n = 0;
+	if(m->fg_deadline.fd != -1){
+		fds[n].fd = m->fg_deadline.fd;
+		fds[n].events = POLLIN;
+		fds[n++].revents = 0;
+	}
+	for(int i = 0; i < m->no_jobs; i++){
+		if(m->jobs[i]->timer.fd != -1){
+			fds[n].fd = m->jobs[i]->timer.fd;
+			fds[n].events = POLLIN;
+			fds[n++].revents = 0;
+		}
+	}
+	return n;
+}
+
+
+/*
+ * Function: deadline_events
+ * --------------------
+ *  Handles the deadlines that went off. Called before children are reaped, so a process
+ *  group is never signalled after its leader's pid could have been reused.
+ *
+ *  *fds: Poll set from deadline_pollfds, after poll
+ *  n: Number of timers in fds
+ */
+void deadline_events(struct pollfd *fds, int n){
+
+	for(int i = 0; i < n; i++){
+		if(!(fds[i].revents & POLLIN)){
+			continue;
+		}
+		if(fds[i].fd == m->fg_deadline.fd){
+			deadline_expire(&m->fg_deadline, m->fg_pid);
+			continue;
+		}
+		for(int k = 0; k < m->no_jobs; k++){
+			if(m->jobs[k]->timer.fd == fds[i].fd){
+				deadline_expire(&m->jobs[k]->timer, m->jobs[k]->pid);
+				break;
+			}
+		}
+	}
+}
+
+
+/*
+ * Function: timeout_run
+ * --------------------
+ *  Runs a command in its own process group with a deadline. In the foreground the shell
+ *  waits for the command or the deadline, whichever comes first, and the exit status is
+ *  124 if the deadline went off. With '&' the command is started as a job at once, not
+ *  queued, and its deadline is handled by the event loop.
+ *
+ *  **param: Command and arguments
+ *  no_params: Number of parameters in param
+ *  ns: Nanoseconds until sig is sent, 0 for no deadline
+ *  sig: Signal to send first
+ *  grace: Nanoseconds from sig until SIGKILL, 0 for no SIGKILL
+ *
+ *  returns: 0 on success or error in the command, -1 on fork error.
+ */
+int timeout_run(char **param, int no_params, uint64_t ns, int sig, uint64_t grace){
+
+	/* Background job */
+	if(strcmp(param[no_params - 1], BG_SIGN) == 0){
+		param[no_params - 1] = NULL;
+		if(no_params == 1){
+			return 0;
+		}
+		size_t no_jobs = m->no_jobs;
+		int ret = launch_job(param, &m->place);
+		if(ret == 0 && ns && m->no_jobs > no_jobs){
+			deadline_arm(&m->jobs[m->no_jobs - 1]->timer, ns, sig, grace);
+		}
+		return ret;
+	}
+
+	pid_t pid = fork();
+
+	/* Child, in its own group so everything it starts is signalled */
+	if(pid == 0){
+		setpgid(0, 0);
+		if(!exec_command(param[0], param)){
+			exit(EXIT_SUCCESS);
+		}
+		exit(EXIT_FAILURE);
+	}
+	else if(pid < 0){
+		fprintf(stderr, "ERROR: Unable to fork");
+		return -1;
+	}
+
+	/* Also in the parent, the group must exist before it is signalled */
+	setpgid(pid, pid);
+	if(ns){
+		deadline_arm(&m->fg_deadline, ns, sig, grace);
+	}
+
+	/* As wait_fg, the terminal's SIGINT does not reach another group */
+	int interrupted = FALSE;
+	m->fg_pid = pid;
+	reap_jobs();
+	while(m->fg_pid == pid){
+		ev_poll(-1, admit_timeout());
+		if(m->signal_flag && !interrupted){
+			kill(-pid, SIGINT);
+			interrupted = TRUE;
+		}
+	}
+
+	deadline_clear(&m->fg_deadline);
+	if(m->fg_deadline.stage){
+		m->fg_status = 124 << 8;
+		m->fg_deadline.stage = 0;
+	}
+	return 0;
+}
@@ -0,0 +1,397 @@
+#include "mysh.h"
+
+/* Shell struct */
+extern mysh *m;
+
+
+/*
+ * Function: var_slot
+ * --------------------
+ *  Finds the slot of a name in the variable table, open addressing with linear probing.
+ *
+ *  *name: Name, not NUL terminated
+ *  len: Length of name
+ *  hash: Hash of name
+ *
+ *  returns: Slot with the name, or the empty slot where it would go.
+ */
+static var *var_slot(const char *name, size_t len, uint32_t hash){
+
+	size_t mask = m->vars_cap - 1;
+	for(size_t i = hash & mask; ; i = (i + 1) & mask){
+		var *v = &m->vars[i];
+		if(v->name == NULL || (v->hash == hash && strncmp(v->name, name, len) == 0 && v->name[len] == '\0')){
+			return v;
+		}
+	}
+}
+
+
+/*
+ * Function: var_grow
+ * --------------------
+ *  Doubles the variable table, starting at VAR_SLOTS.
+ *
+ *  returns: 0 on success, -1 if out of memory.
+ */
+static int var_grow(){
+
+	size_t cap = m->vars_cap ? 2 * m->vars_cap : VAR_SLOTS;
+	var *old = m->vars;
+	size_t old_cap = m->vars_cap;
+
+	var *vars = mysh_malloc(cap * sizeof(var));
+	if(vars == NULL){
+		return -1;
+	}
+	memset(vars, 0, cap * sizeof(var));
+	m->vars = vars;
+	m->vars_cap = cap;
+
+	for(size_t i = 0; i < old_cap; i++){
+		if(old[i].name != NULL){
+			*var_slot(old[i].name, strlen(old[i].name), old[i].hash) = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+
+/*
+ * Function: var_name_len
+ * --------------------
+ *  Length of a variable name at the start of a string: a letter or '_', then letters,
+ *  digits and '_'.
+ *
+ *  *str: String
+ *
+ *  returns: Length of the name, 0 if there is none.
+ */
+size_t var_name_len(const char *str){
+
+	size_t len = 0;
+	if(*str != '_' && !((*str | 0x20) >= 'a' && (*str | 0x20) <= 'z')){
+		return 0;
+	}
+	while(str[len] == '_' || ((str[len] | 0x20) >= 'a' && (str[len] | 0x20) <= 'z') || (str[len] >= '0' && str[len] <= '9')){
+		len++;
+	}
+	return len;
+}
+
+
+/*
+ * Function: var_get
+ * --------------------
+ *  Value of a variable, from the shell's variables or else the environment. The value
+ *  is not copied: it is valid until the variable is set again.
+ *
+ *  *name: Name, not NUL terminated
+ *  len: Length of name
+ *
+ *  returns: Value, NULL if not set.
+ */
+const char *var_get(const char *name, size_t len){
+
+	if(m->no_vars){
+		var *v = var_slot(name, len, hist_hash(name, len));
+		if(v->name != NULL){
+			return v->value;
+		}
+	}
+
+	char env[VAR_NAME];
+	if(len >= VAR_NAME){
+		return NULL;
+	}
+	memcpy(env, name, len);
+	env[len] = '\0';
+	return getenv(env);
+}
+
+
+/*
+ * Function: var_set
+ * --------------------
+ *  Sets a variable. Names are interned in the table once, values are stored in a buffer
+ *  of the variable that is only reallocated when a longer value does not fit.
+ *
+ *  *name: Name, not NUL terminated
+ *  len: Length of name
+ *  *value: Value
+ *
+ *  returns: 0 on success, -1 if out of memory.
+ */
+int var_set(const char *name, size_t len, const char *value){
+
+	if(4 * (m->no_vars + 1) > 3 * m->vars_cap && var_grow() == -1){
+		return -1;
+	}
+
+	uint32_t hash = hist_hash(name, len);
+	var *v = var_slot(name, len, hash);
+	if(v->name == NULL){
+		char *interned = mysh_malloc(len + 1);
+		if(interned == NULL){
+			return -1;
+		}
+		memcpy(interned, name, len);
+		interned[len] = '\0';
+		v->name = interned;
+		v->hash = hash;
+		v->value = NULL;
+		v->size = 0;
+		m->no_vars++;
+	}
+
+	size_t value_len = strlen(value);
+	if(value_len + 1 > v->size){
+		size_t size = value_len + 1 < VAR_VALUE ? VAR_VALUE : value_len + 1;
+		char *buf = mysh_realloc(v->value, size);
+		if(buf == NULL){
+			return -1;
+		}
+		v->value = buf;
+		v->size = size;
+	}
+	memcpy(v->value, value, value_len + 1);
+	return 0;
+}
+
+
+/*
+ * Function: var_assign
+ * --------------------
+ *  Performs the assignments 'NAME=value' at the start of a command. They are shell
+ *  variables that stay set after the command, not environment variables for it: commands
+ *  are run with an empty environment, so 'NAME=value cmd' does not pass NAME to cmd.
+ *
+ *  **param: Command and arguments
+ *
+ *  returns: Number of assignments, i.e the index of the command after them.
+ */
+int var_assign(char **param){
+
+	int n = 0;
+	for(; param[n]; n++){
+		size_t len = var_name_len(param[n]);
+		if(len == 0 || param[n][len] != '='){
+			break;
+		}
+		if(var_set(param[n], len, param[n] + len + 1) == -1){
+			fprintf(stderr, "ERROR: Failed to allocate memory\n");
+		}
+	}
+	return n;
+}
+
+
+/* Arithmetic: recursive descent over 64 bit integers, wrapping on overflow */
+
+/* Parse state, noeval while parsing an operand that is not used */
+typedef struct arith{
+	const char *p;
+	const char *err;
+	int noeval;
+} arith;
+
+static int64_t arith_cond(arith *a);
+
+
+/*
+ * Function: skip
+ * --------------------
+ *  Skips blanks, then checks for an operator.
+ *
+ *  returns: 1 and moves past op if it is next, 0 if not.
+ */
+static int skip(arith *a, const char *op){
+
+	a->p += strspn(a->p, ARGS_DELIM);
+	size_t len = strlen(op);
+	if(strncmp(a->p, op, len) != 0){
+		return FALSE;
+	}
+	/* A one character operator that starts a longer one: '<' in '<=', '&' in '&&' */
+	if(len == 1 && a->p[1] != '\0' && ((strchr("<>&|", op[0]) && a->p[1] == op[0]) || (strchr("<>!", op[0]) && a->p[1] == '='))){
+		return FALSE;
+	}
+	a->p += len;
+	return TRUE;
+}
+
+
+/*
+ * Function: arith_unary
+ * --------------------
+ *  Numbers, variables, parentheses and the unary operators + - ! ~.
+ */
+static int64_t arith_unary(arith *a){
+
+	if(skip(a, "(")){
+		int64_t v = arith_cond(a);
+		if(!skip(a, ")") && !a->err){
+			a->err = "missing ')'";
+		}
+		return v;
+	}
+	if(skip(a, "-")){
+		return (int64_t)(0 - (uint64_t)arith_unary(a));
+	}
+	if(skip(a, "+")){
+		return arith_unary(a);
+	}
+	if(skip(a, "!")){
+		return !arith_unary(a);
+	}
+	if(skip(a, "~")){
+		return ~arith_unary(a);
+	}
+
+	/* Number: decimal, 0x hex or 0 octal */
+	if(*a->p >= '0' && *a->p <= '9'){
+		char *end;
+		int64_t v = (int64_t)strtoull(a->p, &end, 0);
+		a->p = end;
+		return v;
+	}
+
+	/* Variable, unset or not a number is 0 */
+	if(*a->p == '$'){
+		a->p++;
+	}
+	size_t len = var_name_len(a->p);
+	if(len){
+		const char *value = var_get(a->p, len);
+		a->p += len;
+		return value ? (int64_t)strtoull(value, NULL, 0) : 0;
+	}
+
+	if(!a->err){
+		a->err = *a->p ? "syntax error" : "missing operand";
+	}
+	return 0;
+}
+
+
+/*
+ * Function: arith_binary
+ * --------------------
+ *  Binary operators by precedence level, lowest first, all left associative. The right
+ *  side of '&&' and '||' is not evaluated when the left side decides, as in C.
+ */
+static int64_t arith_binary(arith *a, int level){
+
+	static const char *ops[][4] = {
+		{ "||" }, { "&&" }, { "|" }, { "^" }, { "&" }, { "==", "!=" },
+		{ "<=", ">=", "<", ">" }, { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" }
+	};
+	if(level == sizeof(ops) / sizeof(ops[0])){
+		return arith_unary(a);
+	}
+
+	int64_t l = arith_binary(a, level + 1);
+	while(!a->err){
+		const char *op = NULL;
+		for(int i = 0; i < 4 && ops[level][i]; i++){
+			if(skip(a, ops[level][i])){
+				op = ops[level][i];
+				break;
+			}
+		}
+		if(op == NULL){
+			break;
+		}
+
+		int decided = (op[1] == '&' && !l) || (op[1] == '|' && l);
+		a->noeval += decided;
+		int64_t r = arith_binary(a, level + 1);
+		a->noeval -= decided;
+		uint64_t ul = l, ur = r;
+		if((op[0] == '/' || op[0] == '%') && r == 0){
+			if(!a->noeval){
+				a->err = "division by zero";
+			}
+			l = 0;
+			continue;
+		}
+		switch(op[0] | (op[1] << 8)){
+			case '|' | ('|' << 8): l = l || r; break;
+			case '&' | ('&' << 8): l = l && r; break;
+			case '|': l = ul | ur; break;
+			case '^': l = ul ^ ur; break;
+			case '&': l = ul & ur; break;
+			case '=' | ('=' << 8): l = l == r; break;
+			case '!' | ('=' << 8): l = l != r; break;
+			case '<' | ('=' << 8): l = l <= r; break;
+			case '>' | ('=' << 8): l = l >= r; break;
+			case '<': l = l < r; break;
+			case '>': l = l > r; break;
+			case '<' | ('<' << 8): l = ul << (ur & 63); break;
+			case '>' | ('>' << 8): l = l >> (ur & 63); break;
+			case '+': l = ul + ur; break;
+			case '-': l = ul - ur; break;
+			case '*': l = ul * ur; break;
+			case '/': l = (l == INT64_MIN && r == -1) ? l : l / r; break;
+			case '%': l = (l == INT64_MIN && r == -1) ? 0 : l % r; break;
+		}
+	}
+	return l;
+}
+
+
+/*
+ * Function: arith_cond
+ * --------------------
+ *  Conditional operator 'c ? a : b', the lowest precedence. Only the branch taken is
+ *  evaluated.
+ */
+static int64_t arith_cond(arith *a){
+
+	int64_t c = arith_binary(a, 0);
+	if(a->err || !skip(a, "?")){
+		return c;
+	}
+	a->noeval += !c;
+	int64_t t = arith_cond(a);
+	a->noeval -= !c;
+	if(!skip(a, ":")){
+		if(!a->err){
+			a->err = "missing ':'";
+		}
+		return 0;
+	}
+	a->noeval += !!c;
+	int64_t f = arith_cond(a);
+	a->noeval -= !!c;
+	return c ? t : f;
+}
+
+
+/*
+ * Function: arith_eval
+ * --------------------
+ *  Evaluates an arithmetic expression as in $((...)): 64 bit signed integers with the
+ *  operators of C, except assignment and ++/--. Variables are used by name, with or
+ *  without '$'.
+ *
+ *  *expr: Expression
+ *  *result: Where to store the value
+ *
+ *  returns: 0 on success, -1 on error (printed).
+ */
+int arith_eval(const char *expr, int64_t *result){
+
+	arith a = { expr, NULL, 0 };
+	*result = arith_cond(&a);
+	a.p += strspn(a.p, ARGS_DELIM);
+	if(!a.err && *a.p){
+		a.err = "syntax error";
+	}
+	if(a.err){
+		fprintf(stderr, "mysh: $((%s)): %s\n", expr, a.err);
+		return -1;
+	}
+	return 0;
+}